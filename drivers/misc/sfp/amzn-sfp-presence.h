@@ -0,0 +1,84 @@
+/*
+ * Copyright Amazon.com, Inc. and its affiliates. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/gpl-2.0.html>.
+ *
+ * Presence providers of the driver for SFP+, QSFP+, QSFP28 and QSFP-DD
+ * modules.  A provider reports the presence, and optionally IntL, of a
+ * set of ports as bitmaps, typically from one register of a CPLD, so
+ * that the driver doesn't have to probe every module over I2C.  A port
+ * is bound to a provider in the firmware description of its module:
+ *
+ *     sfp@50 {
+ *         compatible = "qsfp-dd";
+ *         reg = <0x50>;
+ *         amzn,presence = "cpld0";
+ *         amzn,presence-bit = <5>;
+ *     };
+ *
+ * Ports probe-defer until their provider is registered.
+ */
+
+#ifndef _AMZN_SFP_PRESENCE_H_
+#define	_AMZN_SFP_PRESENCE_H_
+
+#include <linux/list.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+
+struct regmap;
+
+/* Ports per provider */
+#define	AMZN_SFP_PRESENCE_BITS	64
+
+struct amzn_sfp_presence {
+	const char		*name;
+	unsigned int		nbits;
+	/*
+	 * Read the bitmaps; a set bit means present, or IntL asserted.
+	 * 'intl' can be left alone by providers without IntL.  May sleep.
+	 */
+	int			(*read)(struct amzn_sfp_presence *,
+				    u64 *present, u64 *intl);
+
+	/* Private to the driver */
+	struct list_head	link;
+	struct list_head	ports;
+	struct delayed_work	work;
+	u64			present;
+	bool			valid;
+};
+
+int	amzn_sfp_presence_register(struct amzn_sfp_presence *);
+void	amzn_sfp_presence_unregister(struct amzn_sfp_presence *);
+/* Have the bitmaps read right away, e.g. from a CPLD interrupt. */
+void	amzn_sfp_presence_changed(struct amzn_sfp_presence *);
+
+/*
+ * A provider reading consecutive registers of a regmap, 'stride' apart,
+ * with the bits of port 0 in the least significant bit of the first.
+ */
+struct amzn_sfp_presence_regmap {
+	struct amzn_sfp_presence prov;
+	struct regmap		*map;
+	unsigned int		present_reg;
+	unsigned int		intl_reg;	/* with has_intl */
+	unsigned int		stride;
+	bool			has_intl;
+	bool			active_low;	/* 0 means present/asserted */
+};
+
+int	amzn_sfp_presence_regmap_register(struct amzn_sfp_presence_regmap *);
+
+#endif /* _AMZN_SFP_PRESENCE_H_ */
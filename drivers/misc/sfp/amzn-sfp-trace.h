@@ -0,0 +1,109 @@
+/*
+ * Copyright Amazon.com, Inc. and its affiliates. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/gpl-2.0.html>.
+ *
+ * Tracepoints of the driver for SFP+, QSFP+, QSFP28 and QSFP-DD modules.
+ * The format of amzn_sfp_request is what amzn-sfp-trace records; keep
+ * the two in sync.
+ */
+
+#undef TRACE_SYSTEM
+#define	TRACE_SYSTEM amzn_sfp
+
+#if !defined(_AMZN_SFP_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define	_AMZN_SFP_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+/* Requests made of the driver. */
+#define	AMZN_SFP_OP_READ	0	/* eeprom file read */
+#define	AMZN_SFP_OP_WRITE	1	/* eeprom file write */
+#define	AMZN_SFP_OP_GATHER	2	/* one port of a gather request */
+
+#define	amzn_sfp_show_op(op)						\
+	__print_symbolic(op,						\
+	    { AMZN_SFP_OP_READ,		"read" },			\
+	    { AMZN_SFP_OP_WRITE,	"write" },			\
+	    { AMZN_SFP_OP_GATHER,	"gather" })
+
+TRACE_EVENT(amzn_sfp_request,
+	TP_PROTO(int port, int op, loff_t offset, size_t length),
+	TP_ARGS(port, op, offset, length),
+	TP_STRUCT__entry(
+		__field(int,	port)
+		__field(int,	op)
+		__field(u32,	offset)
+		__field(u32,	length)
+	),
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->op = op;
+		__entry->offset = offset;
+		__entry->length = length;
+	),
+	TP_printk("port=%d op=%s offset=%u length=%u", __entry->port,
+	    amzn_sfp_show_op(__entry->op), __entry->offset, __entry->length)
+);
+
+TRACE_EVENT(amzn_sfp_request_done,
+	TP_PROTO(int port, int op, loff_t offset, ssize_t result),
+	TP_ARGS(port, op, offset, result),
+	TP_STRUCT__entry(
+		__field(int,	port)
+		__field(int,	op)
+		__field(u32,	offset)
+		__field(int,	result)
+	),
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->op = op;
+		__entry->offset = offset;
+		__entry->result = result;
+	),
+	TP_printk("port=%d op=%s offset=%u result=%d", __entry->port,
+	    amzn_sfp_show_op(__entry->op), __entry->offset, __entry->result)
+);
+
+/* I2C transfers on the bus, with their duration. */
+TRACE_EVENT(amzn_sfp_xfer,
+	TP_PROTO(int port, u16 addr, int nmsgs, u64 ns, int result),
+	TP_ARGS(port, addr, nmsgs, ns, result),
+	TP_STRUCT__entry(
+		__field(int,	port)
+		__field(u16,	addr)
+		__field(int,	nmsgs)
+		__field(u64,	ns)
+		__field(int,	result)
+	),
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->addr = addr;
+		__entry->nmsgs = nmsgs;
+		__entry->ns = ns;
+		__entry->result = result;
+	),
+	TP_printk("port=%d addr=0x%02x nmsgs=%d ns=%llu result=%d",
+	    __entry->port, __entry->addr, __entry->nmsgs, __entry->ns,
+	    __entry->result)
+);
+
+#endif /* _AMZN_SFP_TRACE_H_ */
+
+/* The header lives next to the driver, not in include/trace/events. */
+#undef TRACE_INCLUDE_PATH
+#define	TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define	TRACE_INCLUDE_FILE amzn-sfp-trace
+#include <trace/define_trace.h>
@@ -20,7 +20,36 @@
 #include <linux/i2c.h>
 #include <linux/module.h>
 #include <linux/sysfs.h>
+#include <linux/cdev.h>
+#include <linux/crc32.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
+#include <linux/fs.h>
+#include <linux/idr.h>
+#include <linux/interrupt.h>
+#include <linux/kfifo.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/property.h>
+#include <linux/regmap.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+#include <asm/unaligned.h>
+#include <net/genetlink.h>
+
+#include "amzn-sfp.h"
+#include "amzn-sfp-presence.h"
+
+#define	CREATE_TRACE_POINTS
+#include "amzn-sfp-trace.h"
 
 #ifdef CONFIG_SYSCTL
 #include <linux/sysctl.h>
@@ -42,6 +71,609 @@
 /* Page select register for QSFP+, QSFP28 and QSFP-DD modules. */
 #define	AMZN_QSFP_PAGE_SELECT	127
 
+/*
+ * The SPI-I2C controller has a limited buffer size (96 bytes) and the
+ * driver simply returns EOPNOTSUPP when a larger transfer is requested.
+ * Bad driver!  Never transfer more than this in one go.
+ */
+#define	AMZN_SFP_MAX_XFER	64
+
+/*
+ * Layout of the per-port transfer buffer, which is kmalloc'ed so that
+ * controllers can DMA to and from it without bouncing: the page select
+ * register and page, the page read back, the register address, and
+ * then up to max_xfer data bytes.  What's read by the module, the page
+ * and the data, starts a cacheline of its own, so that mapping it for a
+ * read on a controller without coherent DMA can't drop bytes the CPU
+ * wrote for the same transfer.
+ */
+#ifdef ARCH_DMA_MINALIGN
+#define	AMZN_SFP_XFER_ALIGN	ARCH_DMA_MINALIGN
+#else
+#define	AMZN_SFP_XFER_ALIGN	__alignof__(unsigned long long)
+#endif
+#define	AMZN_SFP_XFER_SEL	0	/* 2 bytes */
+#define	AMZN_SFP_XFER_CUR	AMZN_SFP_XFER_ALIGN
+#define	AMZN_SFP_XFER_REG	(AMZN_SFP_XFER_DATA - 1)
+#define	AMZN_SFP_XFER_DATA	(2 * AMZN_SFP_XFER_ALIGN)
+
+/* Interval (ms) at which ports in an IntL storm are polled instead. */
+#define	AMZN_SFP_INTL_STORM_POLL	1000
+
+/* Offset of the EEPROM image in the mapping of a per-port device. */
+#define	AMZN_SFP_IMAGE_DATA	4096
+
+/* Flat memory (no upper pages other than 00h) indication. */
+#define	AMZN_SFF8636_FLAT_MEM		0x04	/* byte 2 */
+#define	AMZN_CMIS_FLAT_MEM		0x80	/* byte 2 */
+
+/* CMIS revision (byte 1), major in the high nibble. */
+#define	AMZN_CMIS_REV			1
+#define	AMZN_CMIS_REV_5_0		0x50
+
+/*
+ * Registers used to determine whether a freshly inserted module is
+ * ready to be accessed.
+ * SFF-8636: byte 2, bit 0 is Data_Not_Ready.
+ * CMIS: byte 3, bits 3-1 hold the module state.
+ * SFF-8472: A0h byte 92, bit 6 says DDM is implemented, in which case
+ * A2h byte 110, bit 0 is Data_Ready_Bar.
+ */
+#define	AMZN_SFF8636_STATUS		2
+#define	AMZN_SFF8636_DATA_NOT_READY	0x01
+#define	AMZN_CMIS_MODULE_STATE		3
+#define	AMZN_CMIS_MODULE_STATE_MASK	0x0e
+#define	AMZN_CMIS_MODULE_STATE_SHIFT	1
+#define	AMZN_CMIS_MODULE_LOWPWR		1
+#define	AMZN_CMIS_MODULE_PWRUP		2
+#define	AMZN_CMIS_MODULE_READY		3
+#define	AMZN_CMIS_MODULE_PWRDN		4
+#define	AMZN_CMIS_MODULE_FAULT		5
+#define	AMZN_SFF8472_DIAG_TYPE		92
+#define	AMZN_SFF8472_DIAG_DDM		0x40
+#define	AMZN_SFF8472_STATUS		(AMZN_SFP_FULL_SIZE + 110)
+#define	AMZN_SFF8472_DATA_READY_BAR	0x01
+
+/*
+ * The rest of the diagnostic monitoring type, A0h byte 92.  Modules
+ * without DDM, or that need a vendor specific address change sequence
+ * before A2h can be accessed, get no A2h accesses once byte 92 was read,
+ * not even for readiness.
+ */
+#define	AMZN_SFF8472_DIAG_INTERNAL	0x20	/* internally calibrated */
+#define	AMZN_SFF8472_DIAG_EXTERNAL	0x10	/* externally calibrated */
+#define	AMZN_SFF8472_DIAG_ADDR_CHANGE	0x04
+#define	AMZN_SFF8472_HAS_A2(type)					\
+	(((type) & AMZN_SFF8472_DIAG_DDM) &&				\
+	 !((type) & AMZN_SFF8472_DIAG_ADDR_CHANGE))
+
+/*
+ * Tunable SFP+ modules (SFF-8690).  A0h byte 65, bit 6 says whether the
+ * transmitter is tunable.  The tuning registers are on page 02h of A2h,
+ * which is selected with A2h byte 127, if A0h byte 64, bit 4 says A2h
+ * is paged.  The eeprom file only gives access to page 00h of A2h.
+ */
+#define	AMZN_SFF8472_OPTIONS		64	/* 2 bytes */
+#define	AMZN_SFF8472_OPT_PAGING		0x10	/* byte 64 */
+#define	AMZN_SFF8472_OPT_TUNABLE	0x40	/* byte 65 */
+#define	AMZN_SFF8472_A2			AMZN_SFP_FULL_SIZE
+#define	AMZN_SFF8472_PAGE_SELECT	127
+#define	AMZN_SFF8690_PAGE		0x02
+#define	AMZN_SFF8690_CHANNEL		144	/* 2 bytes */
+#define	AMZN_SFF8690_WAVELENGTH		146	/* 2 bytes, in 0.05nm */
+#define	AMZN_SFF8690_STATUS		168
+#define	AMZN_SFF8690_TX_TUNE		0x10	/* tuning in progress */
+#define	AMZN_SFF8690_LATCHED		172
+#define	AMZN_SFF8690_L_BAD_CHANNEL	0x10
+#define	AMZN_SFF8690_L_NEW_CHANNEL	0x08
+
+/*
+ * Performance monitoring of coherent modules (C-CMIS).  The PM pages
+ * are frozen with the versatile diagnostics monitoring (VDM) controls
+ * on page 2Fh, so that they're read as one consistent set, and then
+ * unfrozen again.  Modules qualify when they advertise VDM (page 01h
+ * byte 142) and single mode fiber media (byte 85) with a coherent media
+ * interface (SFF-8024) as their first application (byte 87).
+ */
+#define	AMZN_CMIS_VDM_SUPPORTED		0x40
+#define	AMZN_CMIS_MEDIA_TYPE		85
+#define	AMZN_CMIS_MEDIA_SMF		0x02
+#define	AMZN_CMIS_MEDIA_IF		87
+#define	AMZN_CMIS_VDM_PAGE		0x2f
+#define	AMZN_CMIS_VDM_FLAGS_PAGE	0x2c	/* latched, clear-on-read */
+#define	AMZN_CMIS_VDM_MASKS_PAGE	0x2d
+#define	AMZN_CMIS_VDM_FREEZE		144
+#define	AMZN_CMIS_VDM_FREEZE_REQ	0x80
+#define	AMZN_CMIS_VDM_FREEZE_DONE	145
+#define	AMZN_CMIS_VDM_FROZEN		0x80
+#define	AMZN_CMIS_PM_FIRST		0x33
+#define	AMZN_CMIS_PM_PAGES		3
+#define	AMZN_CMIS_PM_SIZE		(AMZN_CMIS_PM_PAGES * AMZN_SFP_HALF_SIZE)
+#define	AMZN_CMIS_FREEZE_TRIES		10	/* 1ms apart */
+#define	AMZN_SFP_PM_BACKOFF_MAX		6	/* 64 intervals */
+
+/*
+ * PRBS diagnostics of CMIS modules.  Page 13h has the controls of the
+ * pattern generators, checkers and loopbacks, one bit or nibble per
+ * lane.  Page 14h shows a result set chosen with the selector; writing
+ * the selector latches the error and bit counters of four lanes of one
+ * side into the data area, as 64-bit error count and 64-bit bit count
+ * per lane.
+ */
+#define	AMZN_CMIS_PAGES_SUPPORTED	AMZN_SFP_PAGE_OFFSET(0x01, 142)
+#define	AMZN_CMIS_DIAG_SUPPORTED	0x20
+#define	AMZN_CMIS_DIAG_PAGE		0x13
+#define	AMZN_CMIS_HOST_GEN_EN		144
+#define	AMZN_CMIS_HOST_GEN_PAT		148
+#define	AMZN_CMIS_MEDIA_GEN_EN		152
+#define	AMZN_CMIS_MEDIA_GEN_PAT		156
+#define	AMZN_CMIS_HOST_CHK_EN		160
+#define	AMZN_CMIS_HOST_CHK_PAT		164
+#define	AMZN_CMIS_MEDIA_CHK_EN		168
+#define	AMZN_CMIS_MEDIA_CHK_PAT		172
+#define	AMZN_CMIS_LOOPBACK		180	/* 4 bytes, media out first */
+#define	AMZN_CMIS_RESULT_PAGE		0x14
+#define	AMZN_CMIS_DIAG_SELECT		128
+#define	AMZN_CMIS_DIAG_SEL_HOST		0x02	/* +1 for lanes 5-8 */
+#define	AMZN_CMIS_DIAG_SEL_MEDIA	0x04	/* +1 for lanes 5-8 */
+#define	AMZN_CMIS_DIAG_DATA		192
+#define	AMZN_CMIS_DIAG_DATA_SIZE	64
+#define	AMZN_CMIS_DIAG_LATCH_US		2000	/* selector to data */
+
+/*
+ * Data path state of the host lanes of a CMIS module, a nibble per lane
+ * on page 11h, lane 1 in the low nibble of the first byte.
+ */
+#define	AMZN_CMIS_DP_STATE		AMZN_SFP_PAGE_OFFSET(0x11, 128)
+#define	AMZN_CMIS_DP_DEACTIVATED	0x1
+#define	AMZN_SFP_LANES_REFRESH_MS	1000
+
+/*
+ * Pages a module advertises, for dumps.
+ * SFF-8636: page 00h byte 195 says whether pages 01h and 02h exist.
+ * CMIS: page 01h byte 142 says whether page 03h, the diagnostic pages
+ * 13h-14h and the VDM pages 20h-2Fh exist, and page 2Fh byte 128 how
+ * many VDM groups there are.
+ */
+#define	AMZN_SFF8636_OPTIONS		AMZN_SFP_PAGE_OFFSET(0x00, 195)
+#define	AMZN_SFF8636_OPT_PAGE01		0x40
+#define	AMZN_SFF8636_OPT_PAGE02		0x80
+#define	AMZN_CMIS_PAGE03_SUPPORTED	0x04
+#define	AMZN_CMIS_VDM_GROUPS		128	/* bits 1-0: groups - 1 */
+#define	AMZN_SFP_DUMP_MAX_HALVES	32
+#define	AMZN_SFP_DUMP_HOLD_MS		5000	/* of an unfinished read */
+
+#define	AMZN_SFP_DIAG_LANES		8
+#define	AMZN_SFP_DIAG_INTERVAL		1000	/* ms */
+#define	AMZN_SFP_DIAG_GEN_MASK						\
+	(AMZN_SFP_DIAG_GEN_HOST | AMZN_SFP_DIAG_GEN_MEDIA |		\
+	 AMZN_SFP_DIAG_CHK_HOST | AMZN_SFP_DIAG_CHK_MEDIA)
+#define	AMZN_SFP_DIAG_LB_MASK						\
+	(AMZN_SFP_DIAG_LB_MEDIA_OUT | AMZN_SFP_DIAG_LB_MEDIA_IN |	\
+	 AMZN_SFP_DIAG_LB_HOST_OUT | AMZN_SFP_DIAG_LB_HOST_IN)
+
+/*
+ * Tuning is polled for completion starting at 5ms, backing off to
+ * 100ms, for at most 30s by default.
+ */
+#define	AMZN_SFP_TUNE_POLL_MIN		5
+#define	AMZN_SFP_TUNE_POLL_MAX		100
+#define	AMZN_SFP_TUNE_TIMEOUT		30000
+
+/*
+ * Module state as tracked by the presence poller.  Until the poller
+ * has run (or when it is disabled) the state is unknown and accesses
+ * are passed through to the module as-is.
+ */
+#define	AMZN_SFP_STATE_UNKNOWN		0
+#define	AMZN_SFP_STATE_ABSENT		1
+#define	AMZN_SFP_STATE_NOT_READY	2
+#define	AMZN_SFP_STATE_IDENTIFYING	3
+#define	AMZN_SFP_STATE_READY		4
+
+/* Bounds (in ms) of the back-off used to poll a not ready module. */
+#define	AMZN_SFP_READY_POLL_MIN	10
+#define	AMZN_SFP_READY_POLL_MAX	500
+
+/* Number of attempts (100ms apart) at identifying a module. */
+#define	AMZN_SFP_IDENT_TRIES	3
+
+/*
+ * Per-port tasks, executed by the worker of the bus the port is on.
+ * The task number doubles as the priority: lower numbers run first.
+ * Identification of freshly inserted modules thus always goes ahead
+ * of routine polling.
+ */
+#define	AMZN_SFP_TASK_BURST	0	/* Burst capture after an event */
+#define	AMZN_SFP_TASK_READY	1	/* Readiness of an inserted module */
+#define	AMZN_SFP_TASK_IDENTIFY	2	/* Identification of a ready module */
+#define	AMZN_SFP_TASK_TUNE	3	/* Completion of tuning */
+#define	AMZN_SFP_TASK_INTL	4	/* Servicing of IntL */
+#define	AMZN_SFP_TASK_GATHER	5	/* Multi-port gather requests */
+#define	AMZN_SFP_TASK_DIAG	6	/* PRBS diagnostic sessions */
+#define	AMZN_SFP_TASK_PM	7	/* C-CMIS performance monitoring */
+#define	AMZN_SFP_TASK_POLL	8	/* Poll plan of client interests */
+#define	AMZN_SFP_TASK_HISTORY	9	/* Rolling history of diagnostics */
+#define	AMZN_SFP_TASK_PRESENCE	10	/* Routine presence polling */
+#define	AMZN_SFP_NTASKS		11
+
+/*
+ * Regions in the poll plan that are at most this many bytes apart are
+ * read in one go, unless the gap holds latched flags.
+ */
+#define	AMZN_SFP_POLL_GAP	8
+
+/*
+ * Bus utilisation is measured over windows of this many ns and rolled
+ * into a moving average.  Poll plan entries with an interval of at
+ * least AMZN_SFP_SLOW_POLL_MS are shed when the bus is overloaded.
+ */
+#define	AMZN_SFP_UTIL_WINDOW	(250 * NSEC_PER_MSEC)
+#define	AMZN_SFP_SLOW_POLL_MS	1000
+
+/* Size of the event queue of a client. */
+#define	AMZN_SFP_EVENT_FIFO	16384
+
+/*
+ * Kinds of EEPROM ranges, as far as the shadow cache is concerned.
+ * Static ranges are cached until the module goes away, volatile ranges
+ * for amzn-sfp-cache-ttl-ms.  Latched flags are cleared on read and thus
+ * never cached, nor read ahead.
+ */
+#define	AMZN_SFP_RANGE_VOLATILE	0
+#define	AMZN_SFP_RANGE_STATIC	1
+#define	AMZN_SFP_RANGE_NOCACHE	2
+
+/* A range of the eeprom file.  Tables of ranges are sorted. */
+struct amzn_sfp_range {
+	u32	start;
+	u32	end;
+	int	kind;
+};
+
+#define	AMZN_SFP_PAGE(page)	AMZN_SFP_PAGE_OFFSET(page, AMZN_SFP_HALF_SIZE)
+
+static const struct amzn_sfp_range amzn_sff8472_ranges[] = {
+	/* A0h */
+	{ 0, AMZN_SFP_FULL_SIZE, AMZN_SFP_RANGE_STATIC },
+	/* A2h thresholds and calibration constants */
+	{ AMZN_SFP_FULL_SIZE, AMZN_SFP_FULL_SIZE + 96, AMZN_SFP_RANGE_STATIC },
+};
+
+static const struct amzn_sfp_range amzn_sff8636_ranges[] = {
+	/* Interrupt flags */
+	{ 3, 22, AMZN_SFP_RANGE_NOCACHE },
+	/* Identity */
+	{ AMZN_SFP_PAGE(0x00), AMZN_SFP_PAGE(0x01), AMZN_SFP_RANGE_STATIC },
+	/* Thresholds */
+	{ AMZN_SFP_PAGE(0x03), AMZN_SFP_PAGE(0x04), AMZN_SFP_RANGE_STATIC },
+};
+
+static const struct amzn_sfp_range amzn_cmis_ranges[] = {
+	/* Module flags */
+	{ 8, 12, AMZN_SFP_RANGE_NOCACHE },
+	/* Identity, advertising and thresholds */
+	{ AMZN_SFP_PAGE(0x00), AMZN_SFP_PAGE(0x03), AMZN_SFP_RANGE_STATIC },
+	/* Lane flags */
+	{ AMZN_SFP_PAGE_OFFSET(0x11, 134), AMZN_SFP_PAGE_OFFSET(0x11, 154),
+	  AMZN_SFP_RANGE_NOCACHE },
+	/* VDM flags */
+	{ AMZN_SFP_PAGE(AMZN_CMIS_VDM_FLAGS_PAGE),
+	  AMZN_SFP_PAGE(AMZN_CMIS_VDM_FLAGS_PAGE + 1), AMZN_SFP_RANGE_NOCACHE },
+};
+
+/*
+ * Diagnostics of a module, as sampled for the history and bursts:
+ * monitors and flags.  Latched flags are only read by bursts.
+ */
+static const struct amzn_sfp_range amzn_sff8472_diag[] = {
+	/* A2h monitors, status and alarm and warning flags */
+	{ AMZN_SFP_FULL_SIZE + 96, AMZN_SFP_FULL_SIZE + 118,
+	  AMZN_SFP_RANGE_VOLATILE },
+};
+
+static const struct amzn_sfp_range amzn_sff8636_diag[] = {
+	/* Interrupt flags */
+	{ 3, 15, AMZN_SFP_RANGE_NOCACHE },
+	/* Module and channel monitors */
+	{ 22, 82, AMZN_SFP_RANGE_VOLATILE },
+};
+
+static const struct amzn_sfp_range amzn_cmis_diag[] = {
+	/* Module flags */
+	{ 8, 12, AMZN_SFP_RANGE_NOCACHE },
+	/* Module monitors */
+	{ 14, 26, AMZN_SFP_RANGE_VOLATILE },
+	/* Lane flags and monitors */
+	{ AMZN_SFP_PAGE_OFFSET(0x11, 134), AMZN_SFP_PAGE_OFFSET(0x11, 154),
+	  AMZN_SFP_RANGE_NOCACHE },
+	{ AMZN_SFP_PAGE_OFFSET(0x11, 154), AMZN_SFP_PAGE_OFFSET(0x11, 202),
+	  AMZN_SFP_RANGE_VOLATILE },
+};
+
+/*
+ * Summaries of latched flags.  A range of latched flags starting at
+ * 'start' has nothing latched unless 'bits' of the byte at 'reg' say so,
+ * so reading the summary byte first saves reading the range (and often
+ * a page switch) while there are no alarms.  A summary that follows
+ * IntL only covers unmasked flags and isn't used once masks are set.
+ * Summaries that appeared in a later CMIS revision aren't used with
+ * modules of an earlier one.
+ */
+struct amzn_sfp_summary {
+	u32	start;
+	u32	reg;
+	u8	bits;
+	bool	active_low;
+	bool	intl;
+	u8	cmis_rev;	/* minimum, 0 for any */
+};
+
+static const struct amzn_sfp_summary amzn_sff8636_summaries[] = {
+	/* Byte 2, bit 1 is the state of IntL */
+	{ 3, 2, 0x02, true, true, 0 },
+};
+
+static const struct amzn_sfp_summary amzn_cmis_summaries[] = {
+	/* Byte 3, bit 0 is set while IntL is deasserted */
+	{ 8, 3, 0x01, true, true, 0 },
+	/*
+	 * Byte 4 has a bit per lane with any lane flag of bank 0 set, as
+	 * of CMIS 5.0; before, it's reserved and reads 0.
+	 */
+	{ AMZN_SFP_PAGE_OFFSET(0x11, 134), 4, 0xff, false, false,
+	  AMZN_CMIS_REV_5_0 },
+};
+
+/* A per-lane monitor: 'size' bytes per lane, starting with lane 1. */
+struct amzn_sfp_lane_mon {
+	u32	start;
+	u8	size;
+};
+
+static const struct amzn_sfp_lane_mon amzn_sff8636_lane_mons[] = {
+	{ 34, 2 },				/* Rx power */
+	{ 42, 2 },				/* Tx bias */
+	{ 50, 2 },				/* Tx power */
+};
+
+static const struct amzn_sfp_lane_mon amzn_cmis_lane_mons[] = {
+	{ AMZN_SFP_PAGE_OFFSET(0x11, 154), 2 },	/* Tx power */
+	{ AMZN_SFP_PAGE_OFFSET(0x11, 170), 2 },	/* Tx bias */
+	{ AMZN_SFP_PAGE_OFFSET(0x11, 186), 2 },	/* Rx power */
+};
+
+/*
+ * Interrupt masks of a module.  Each of 'count' flag bytes starting at
+ * 'flags' has a mask byte, starting at 'masks', in which a set bit keeps
+ * the corresponding flag from asserting IntL.
+ */
+struct amzn_sfp_mask_map {
+	u32	flags;
+	u32	masks;
+	u8	count;
+};
+
+#define	AMZN_SFP_MAX_MASKS	32	/* mask bytes per backend */
+
+static const struct amzn_sfp_mask_map amzn_sff8636_masks[] = {
+	/* LOS, fault, LOL, temperature and voltage */
+	{ 3, 100, 5 },
+	/* Channel power and bias alarms and warnings */
+	{ 9, AMZN_SFP_PAGE_OFFSET(0x03, 242), 6 },
+};
+
+static const struct amzn_sfp_mask_map amzn_cmis_masks[] = {
+	/* Module flags */
+	{ 8, 31, 4 },
+	/* Lane flags, bank 0 */
+	{ AMZN_SFP_PAGE_OFFSET(0x11, 134), AMZN_SFP_PAGE_OFFSET(0x10, 213),
+	  20 },
+};
+
+/*
+ * Identity information, as found in the 128 bytes of the identity page
+ * (A0h for SFF-8472 and upper page 00h for SFF-8636 and CMIS).
+ */
+struct amzn_sfp_id_layout {
+	u8	vendor_name;
+	u8	vendor_pn;
+	u8	vendor_rev;
+	u8	vendor_rev_len;
+	u8	vendor_sn;
+	u8	date_code;
+};
+
+static const struct amzn_sfp_id_layout amzn_sff8472_id_layout = {
+	.vendor_name = 20, .vendor_pn = 40, .vendor_rev = 56,
+	.vendor_rev_len = 4, .vendor_sn = 68, .date_code = 84,
+};
+
+static const struct amzn_sfp_id_layout amzn_sff8636_id_layout = {
+	.vendor_name = 20, .vendor_pn = 40, .vendor_rev = 56,
+	.vendor_rev_len = 2, .vendor_sn = 68, .date_code = 84,
+};
+
+static const struct amzn_sfp_id_layout amzn_cmis_id_layout = {
+	.vendor_name = 1, .vendor_pn = 20, .vendor_rev = 36,
+	.vendor_rev_len = 2, .vendor_sn = 38, .date_code = 54,
+};
+
+struct amzn_sfp_ident {
+	u8	identifier;
+	char	vendor_name[17];
+	char	vendor_pn[17];
+	char	vendor_rev[5];
+	char	vendor_sn[17];
+	char	date_code[9];
+	u32	fingerprint;	/* CRC32 of the identity page */
+};
+
+struct amzn_sfp_softc;
+
+/*
+ * The management interface standard a module implements: SFF-8472
+ * for SFP+, SFF-8636 for QSFP+ and QSFP28 and CMIS for QSFP-DD.
+ */
+struct amzn_sfp_backend {
+	const char			*name;
+	loff_t				id_offset;
+	const struct amzn_sfp_id_layout	*id_layout;
+	const struct amzn_sfp_range	*ranges;
+	unsigned int			nranges;
+	const struct amzn_sfp_range	*diag;
+	unsigned int			ndiag;
+	const struct amzn_sfp_mask_map	*masks;
+	unsigned int			nmasks;
+	const struct amzn_sfp_summary	*summaries;
+	unsigned int			nsummaries;
+	const struct amzn_sfp_lane_mon	*lane_mons;
+	unsigned int			nlane_mons;
+	unsigned int			nlanes;
+	int				(*probe_state)(struct amzn_sfp_softc *);
+};
+
+/*
+ * Shadow cache of one half of the EEPROM: the lower half or one of the
+ * upper pages.  The valid bitmap tracks which bytes have been filled.
+ * The data lives in a buffer from amzn_sfp_page_cache.  Pages that hold
+ * only static data are pinned.  All others are on the global LRU list,
+ * from which they are evicted under memory pressure.
+ */
+struct amzn_sfp_cpage {
+	struct list_head	lru;
+	struct amzn_sfp_softc	*sc;
+	unsigned int		half;
+	bool			pinned;
+	unsigned long		ts;
+	DECLARE_BITMAP(valid, AMZN_SFP_HALF_SIZE);
+	u8			*data;
+};
+
+/* Access pattern of an open eeprom file, for readahead. */
+struct amzn_sfp_ra {
+	const struct file	*fp;
+	loff_t			next;
+	unsigned int		window;
+};
+
+#define	AMZN_SFP_RA_SLOTS	4
+
+/*
+ * Bus time is charged to an owner: the process on whose behalf the
+ * transfer is done, or the driver itself for background work.
+ */
+struct amzn_sfp_owner {
+	pid_t			tgid;
+	u64			cgroup;
+	char			comm[TASK_COMM_LEN];
+};
+
+/*
+ * Bus time used by an owner, on a port or on a bus.  On a bus, the
+ * owner also has a token bucket of bus time for quota enforcement.
+ */
+struct amzn_sfp_acct {
+	struct list_head	link;
+	struct amzn_sfp_owner	owner;
+	u64			xfers;
+	u64			bus_ns;
+	u64			throttled;
+	s64			tokens;
+	u64			last;
+};
+
+/* Owners tracked per port and per bus; the least recent go first. */
+#define	AMZN_SFP_ACCT_MAX	32
+
+/*
+ * A multi-port gather request.  The request is shared between the
+ * issuer and the bus workers and freed by whoever is done with it last.
+ * The reads of a sampling round start at the trigger time.
+ */
+struct amzn_sfp_gather_req {
+	struct kref		ref;
+	atomic_t		pending;
+	struct completion	done;
+	u64			trigger;	/* ns, 0 if not a round */
+	u32			offset;
+	u16			length;
+	size_t			stride;
+	u8			*results;
+	struct amzn_sfp_owner	owner;
+	struct amzn_sfp_gather_item {
+		struct list_head	link;
+		struct amzn_sfp_gather_req *req;
+		struct amzn_sfp_gather_result *res;
+	}			items[];
+};
+
+/*
+ * An entry of the poll plan of a port: a region read at an interval, on
+ * behalf of the client that asked for that interval.
+ */
+struct amzn_sfp_poll {
+	u32			offset;
+	u32			length;
+	unsigned int		interval_ms;
+	unsigned long		due;
+	int			status;
+	struct amzn_sfp_owner	owner;
+};
+
+/*
+ * An open port device.  Clients register interests, which are merged
+ * into the poll plan of the port, and read events.
+ */
+struct amzn_sfp_client {
+	struct amzn_sfp_softc	*sc;
+	struct list_head	link;
+	struct amzn_sfp_interest interests[AMZN_SFP_MAX_INTERESTS];
+	unsigned long		due[AMZN_SFP_MAX_INTERESTS];
+	unsigned int		ninterests;
+	struct amzn_sfp_threshold thresholds[AMZN_SFP_MAX_THRESHOLDS];
+	unsigned long		th_due[AMZN_SFP_MAX_THRESHOLDS];
+	unsigned long		th_raised;	/* bitmap */
+	unsigned int		nthresholds;
+	struct amzn_sfp_flags	flag_subs[AMZN_SFP_MAX_FLAG_SUBS];
+	unsigned int		nflag_subs;
+	struct amzn_sfp_owner	owner;
+	spinlock_t		ev_lock;
+	struct mutex		read_lock;
+	struct kfifo		events;
+	bool			ev_lost;
+	wait_queue_head_t	ev_wq;
+};
+
+/*
+ * All ports behind the same root I2C adapter share a bus and with it
+ * a worker.  Workers of different buses run in parallel.
+ */
+struct amzn_sfp_bus {
+	struct list_head	link;
+	struct i2c_adapter	*adapter;
+	struct list_head	ports;
+	spinlock_t		lock;
+	struct delayed_work	work;
+	unsigned long		next_due;
+	struct list_head	accts;
+	unsigned int		nacct;
+	u64			xfers;
+	u64			busy_ns;
+	u64			win_start;
+	u64			win_busy;
+	unsigned int		util;		/* in 0.1% */
+	unsigned int		depth;
+	unsigned int		max_depth;
+	u64			waits;
+	u64			wait_ns;
+	u64			max_wait_ns;
+	u64			shed_ra;
+	u64			shed_poll;
+	unsigned long		intl_win_start;
+	unsigned int		intl_used;
+};
+
 
 struct amzn_sfp_softc {
 	struct bin_attribute	attr;
@@ -50,8 +682,117 @@ struct amzn_sfp_softc {
 	int			sfp_type;
 	int			cur_page;
 	unsigned long		cur_page_ts;
+	int			state;
+	unsigned int		ready_poll_ms;
+	wait_queue_head_t	state_wq;
+	struct amzn_sfp_bus	*bus;
+	struct list_head	bus_link;
+	unsigned long		tasks;
+	unsigned long		task_due[AMZN_SFP_NTASKS];
+	int			ident_tries;
+	bool			id_valid;
+	bool			flat_mem;
+	u8			cmis_rev;	/* CMIS byte 1 */
+	u8			dm_type;	/* SFF-8472 byte 92 */
+	bool			dm_valid;	/* until the module leaves */
+	struct amzn_sfp_ident	ident;
+	const struct amzn_sfp_backend *backend;
+	size_t			max_xfer;	/* read */
+	size_t			max_wxfer;	/* write */
+	u8			*xfer_buf;	/* DMA-safe */
+	struct xarray		cache;
+	struct amzn_sfp_ra	ra[AMZN_SFP_RA_SLOTS];
+	unsigned int		ra_next;
+	int			port_id;
+	struct list_head	gather_items;
+	struct device		dev;
+	struct cdev		cdev;
+	struct amzn_sfp_image_hdr *image;
+	unsigned int		image_halves;
+	bool			gone;
+	struct list_head	clients;
+	struct amzn_sfp_poll	*plan;
+	unsigned int		nplan;
+	u8			*poll_data;
+	const struct amzn_sfp_owner *owner;
+	struct list_head	accts;
+	unsigned int		nacct;
+	bool			tune_active;
+	u8			tune_latched;
+	unsigned int		tune_poll_ms;
+	unsigned long		tune_deadline;
+	u8			*history;
+	size_t			hist_stride;
+	unsigned int		hist_head;
+	unsigned int		hist_count;
+	unsigned int		burst_left;
+	unsigned int		burst_interval_ms;
+	u32			burst_flags;	/* of the samples */
+	bool			pm_unsupported;
+	u8			*pm;
+	u64			pm_ts;
+	int			pm_status;
+	unsigned int		pm_failures;	/* in a row */
+	bool			diag_active;
+	struct amzn_sfp_client	*diag_client;	/* that started it */
+	u32			diag_flags;
+	u8			diag_lanes;
+	unsigned int		diag_interval_ms;
+	unsigned long		diag_deadline;	/* 0 for none */
+	u64			diag_start;
+	u64			diag_ts;
+	int			diag_status;
+	u64			diag_base[2][AMZN_SFP_DIAG_LANES][2];
+	u64			diag_last[2][AMZN_SFP_DIAG_LANES][2];
+	u8			int_masks[AMZN_SFP_MAX_MASKS];
+	bool			masks_set;
+	int			irq;
+	bool			intl_off;	/* under bus lock */
+	bool			intl_storm;
+	unsigned long		intl_rate_start;
+	unsigned int		intl_rate;
+	u64			intl_irqs;
+	u64			intl_serviced;
+	u64			intl_deferred;
+	u64			intl_storms;
+	u8			*dump;		/* last image of 'dump' */
+	size_t			dump_len;
+	const struct file	*dump_fp;	/* reading it */
+	loff_t			dump_next;
+	unsigned long		dump_used;
+	struct amzn_sfp_presence *prov;
+	struct list_head	prov_link;
+	unsigned int		prov_bit;
+	bool			prov_present;
+	u8			lanes_off;	/* inactive lanes */
+	bool			lanes_auto;
+	unsigned long		lanes_due;
 };
 
+static LIST_HEAD(amzn_sfp_buses);
+static DEFINE_MUTEX(amzn_sfp_buses_lock);
+static struct workqueue_struct *amzn_sfp_wq;
+
+/* Registered presence providers, and the ports bound to them. */
+static LIST_HEAD(amzn_sfp_providers);
+static DEFINE_MUTEX(amzn_sfp_presence_lock);
+
+/* All ports, by port ID. */
+static DEFINE_IDR(amzn_sfp_ports);
+static DEFINE_MUTEX(amzn_sfp_ports_lock);
+
+static struct dentry *amzn_sfp_debugfs;
+
+/* Per-port character devices. */
+static dev_t amzn_sfp_devt;
+static struct class *amzn_sfp_class;
+
+/* Shadow cache page buffers and the LRU list of evictable pages. */
+static struct kmem_cache *amzn_sfp_page_cache;
+static LIST_HEAD(amzn_sfp_lru);
+static DEFINE_SPINLOCK(amzn_sfp_lru_lock);
+static unsigned long amzn_sfp_lru_count;
+
 /*
  * The default retention time in seconds of the cur_page variable.
  * By default this is 1 second.
@@ -63,6 +804,79 @@ static int amzn_sfp_page_retention = 1;
  */
 static int amzn_sfp_page_load_wait_ms = 4;
 
+/*
+ * The interval in ms at which module presence and readiness is polled.
+ * A value of 0 disables polling and with it the gating of accesses on
+ * module readiness.
+ */
+static int amzn_sfp_presence_poll_ms = 1000;
+
+/*
+ * The maximum time in ms a blocking read waits for a freshly inserted
+ * module to become ready, before failing with EAGAIN.
+ */
+static int amzn_sfp_ready_wait_ms = 2000;
+
+/*
+ * The time in ms volatile data is served from the shadow cache.  The
+ * default of 0 means volatile data is always read from the module.
+ */
+static int amzn_sfp_cache_ttl_ms = 0;
+
+/*
+ * Whether a read that misses the cache fills the rest of the page, and
+ * the maximum number of pages read ahead for sequential readers.
+ */
+static int amzn_sfp_readahead = 1;
+static int amzn_sfp_readahead_max_pages = 4;
+
+/*
+ * The maximum number of evictable (i.e. not static) pages in the shadow
+ * cache, across all ports.  The shrinker may evict pages before this
+ * limit is reached.
+ */
+static int amzn_sfp_cache_max_pages = 1024;
+
+/*
+ * The bus time in us per second a process may use on a bus through the
+ * eeprom files, before its reads and writes are held off.  The default
+ * of 0 means no limit.
+ */
+static int amzn_sfp_client_quota_us = 0;
+
+/*
+ * The bus utilisation in percent above which readahead and slow polls
+ * are shed, so that control and monitoring traffic gets through.  A
+ * value of 0 disables shedding.
+ */
+static int amzn_sfp_bus_shed_pct = 90;
+
+/*
+ * The interval in ms at which the diagnostics of ready modules are
+ * sampled into the rolling history.  A value of 0 leaves only bursts in
+ * the history.
+ */
+static int amzn_sfp_history_ms = 5000;
+
+/*
+ * The interval in ms at which the PM pages of coherent modules are
+ * collected.  A value of 0 disables collection.
+ */
+static int amzn_sfp_pm_ms = 1000;
+
+/*
+ * Servicing of IntL.  Assertions within amzn-sfp-intl-window-ms of the
+ * first are serviced together, at most amzn-sfp-intl-budget ports per
+ * bus per window (0 for no limit).  A port that asserts IntL more than
+ * amzn-sfp-intl-storm times a second (0 for never) has its interrupt
+ * left disabled and is polled instead until its flags are quiet.  As
+ * IntL is serviced at most once a window, the rate is capped at half
+ * the windows in a second, so a storm is seen with short windows too.
+ */
+static int amzn_sfp_intl_window_ms = 10;
+static int amzn_sfp_intl_budget = 4;
+static int amzn_sfp_intl_storm = 100;
+
 #ifdef CONFIG_SYSCTL
 static struct ctl_table amzn_sfp_sysctls[] = {
     {
@@ -79,38 +893,385 @@ static struct ctl_table amzn_sfp_sysctls[] = {
 	.mode = 0644,
 	.proc_handler = proc_dointvec,
     },
+    {
+	.procname = "amzn-sfp-presence-poll-ms",
+	.data = &amzn_sfp_presence_poll_ms,
+	.maxlen = sizeof(amzn_sfp_presence_poll_ms),
+	.mode = 0644,
+	.proc_handler = proc_dointvec,
+    },
+    {
+	.procname = "amzn-sfp-ready-wait-ms",
+	.data = &amzn_sfp_ready_wait_ms,
+	.maxlen = sizeof(amzn_sfp_ready_wait_ms),
+	.mode = 0644,
+	.proc_handler = proc_dointvec,
+    },
+    {
+	.procname = "amzn-sfp-cache-ttl-ms",
+	.data = &amzn_sfp_cache_ttl_ms,
+	.maxlen = sizeof(amzn_sfp_cache_ttl_ms),
+	.mode = 0644,
+	.proc_handler = proc_dointvec,
+    },
+    {
+	.procname = "amzn-sfp-readahead",
+	.data = &amzn_sfp_readahead,
+	.maxlen = sizeof(amzn_sfp_readahead),
+	.mode = 0644,
+	.proc_handler = proc_dointvec,
+    },
+    {
+	.procname = "amzn-sfp-readahead-max-pages",
+	.data = &amzn_sfp_readahead_max_pages,
+	.maxlen = sizeof(amzn_sfp_readahead_max_pages),
+	.mode = 0644,
+	.proc_handler = proc_dointvec,
+    },
+    {
+	.procname = "amzn-sfp-cache-max-pages",
+	.data = &amzn_sfp_cache_max_pages,
+	.maxlen = sizeof(amzn_sfp_cache_max_pages),
+	.mode = 0644,
+	.proc_handler = proc_dointvec,
+    },
+    {
+	.procname = "amzn-sfp-client-quota-us",
+	.data = &amzn_sfp_client_quota_us,
+	.maxlen = sizeof(amzn_sfp_client_quota_us),
+	.mode = 0644,
+	.proc_handler = proc_dointvec,
+    },
+    {
+	.procname = "amzn-sfp-bus-shed-pct",
+	.data = &amzn_sfp_bus_shed_pct,
+	.maxlen = sizeof(amzn_sfp_bus_shed_pct),
+	.mode = 0644,
+	.proc_handler = proc_dointvec,
+    },
+    {
+	.procname = "amzn-sfp-history-ms",
+	.data = &amzn_sfp_history_ms,
+	.maxlen = sizeof(amzn_sfp_history_ms),
+	.mode = 0644,
+	.proc_handler = proc_dointvec,
+    },
+    {
+	.procname = "amzn-sfp-pm-ms",
+	.data = &amzn_sfp_pm_ms,
+	.maxlen = sizeof(amzn_sfp_pm_ms),
+	.mode = 0644,
+	.proc_handler = proc_dointvec,
+    },
+    {
+	.procname = "amzn-sfp-intl-window-ms",
+	.data = &amzn_sfp_intl_window_ms,
+	.maxlen = sizeof(amzn_sfp_intl_window_ms),
+	.mode = 0644,
+	.proc_handler = proc_dointvec,
+    },
+    {
+	.procname = "amzn-sfp-intl-budget",
+	.data = &amzn_sfp_intl_budget,
+	.maxlen = sizeof(amzn_sfp_intl_budget),
+	.mode = 0644,
+	.proc_handler = proc_dointvec,
+    },
+    {
+	.procname = "amzn-sfp-intl-storm",
+	.data = &amzn_sfp_intl_storm,
+	.maxlen = sizeof(amzn_sfp_intl_storm),
+	.mode = 0644,
+	.proc_handler = proc_dointvec,
+    },
     {
     }
 };
 #endif /* CONFIG_SYSCTL */
 
+static const struct amzn_sfp_owner amzn_sfp_owner_driver = {
+	.tgid = 0,
+	.comm = "amzn-sfp",
+};
 
-static ssize_t amzn_sfp_rw(struct bin_attribute *ba, char *buf, loff_t ofs,
-    size_t len, u16 flags)
+static void amzn_sfp_owner_current(struct amzn_sfp_owner *owner)
 {
-	struct amzn_sfp_softc *sc = ba->private;
-	struct i2c_client *client = sc->client;
-	char iobuf[AMZN_SFP_HALF_SIZE + 1];
-	struct i2c_msg msg[2];
-	unsigned long ts;
-	int error, nmsgs;
-	u16 addr;
-	u8 reg;
 
-	/* Make sure the offset and length are valid. */
-	if (ofs < 0 || ofs >= ba->size)
-		return -ESPIPE;
-	if (len == 0)
-		return -EINVAL;
-	if (ofs + len > ba->size)
-		return -ENOSPC;
+	owner->tgid = task_tgid_nr(current);
+#ifdef CONFIG_CGROUPS
+	rcu_read_lock();
+	owner->cgroup = cgroup_id(task_dfl_cgroup(current));
+	rcu_read_unlock();
+#else
+	owner->cgroup = 0;
+#endif
+	get_task_comm(owner->comm, current->group_leader);
+}
 
-	addr = client->addr;
+/* Refill the token bucket of an owner on a bus, for at most 1 second. */
+static void amzn_sfp_acct_refill(struct amzn_sfp_acct *a, u64 now)
+{
+	int quota = READ_ONCE(amzn_sfp_client_quota_us);
+	s64 burst = (s64)max(quota, 0) * NSEC_PER_USEC;
 
-	rt_mutex_lock(&sc->lock);
+	if (now > a->last)
+		a->tokens += mul_u64_u32_div(min_t(u64, now - a->last,
+		    NSEC_PER_SEC), max(quota, 0), USEC_PER_SEC);
+	a->tokens = min(a->tokens, burst);
+	a->last = now;
+}
+
+/* The least recently used owner in a list that isn't throttled. */
+static struct amzn_sfp_acct *amzn_sfp_acct_victim(struct list_head *list)
+{
+	struct amzn_sfp_acct *a;
+	u64 now = ktime_get_ns();
+
+	if (READ_ONCE(amzn_sfp_client_quota_us) <= 0)
+		return list_last_entry(list, struct amzn_sfp_acct, link);
+	list_for_each_entry_reverse(a, list, link) {
+		amzn_sfp_acct_refill(a, now);
+		if (a->tokens >= 0)
+			return a;
+	}
+	return NULL;
+}
+
+/*
+ * Find the accounting of an owner in a list, creating it if needed.
+ * The list is kept in most recently used order and when it's full, the
+ * least recently used owner that isn't throttled makes room; recycling
+ * a throttled one would hand it a fresh token bucket.  Returns NULL
+ * when out of memory or when every owner in the list is throttled.
+ */
+static struct amzn_sfp_acct *amzn_sfp_acct_get(struct list_head *list,
+    unsigned int *nacct, const struct amzn_sfp_owner *owner, gfp_t gfp)
+{
+	struct amzn_sfp_acct *a;
+
+	list_for_each_entry(a, list, link) {
+		if (a->owner.tgid == owner->tgid &&
+		    a->owner.cgroup == owner->cgroup)
+			goto found;
+	}
+
+	if (*nacct < AMZN_SFP_ACCT_MAX) {
+		a = kzalloc(sizeof(*a), gfp);
+		if (a == NULL)
+			return NULL;
+		(*nacct)++;
+	} else {
+		a = amzn_sfp_acct_victim(list);
+		if (a == NULL)
+			return NULL;
+		list_del(&a->link);
+		memset(a, 0, sizeof(*a));
+	}
+	a->owner = *owner;
+	a->tokens = (s64)max(READ_ONCE(amzn_sfp_client_quota_us), 0) *
+	    NSEC_PER_USEC;
+	a->last = ktime_get_ns();
+	list_add(&a->link, list);
+	return a;
+
+ found:
+	list_move(&a->link, list);
+	return a;
+}
+
+static void amzn_sfp_acct_free(struct list_head *list, unsigned int *nacct)
+{
+	struct amzn_sfp_acct *a, *tmp;
+
+	list_for_each_entry_safe(a, tmp, list, link) {
+		list_del(&a->link);
+		kfree(a);
+	}
+	*nacct = 0;
+}
+
+/*
+ * Close the utilisation window of the bus if it's over and fold it into
+ * the moving average.  Called with the bus lock held.
+ */
+static void amzn_sfp_bus_util(struct amzn_sfp_bus *bus, u64 now)
+{
+	u64 elapsed = now - bus->win_start;
+	unsigned int cur;
+
+	if (now < bus->win_start || elapsed < AMZN_SFP_UTIL_WINDOW)
+		return;
+	cur = min_t(u64, div64_u64(bus->win_busy * 1000, elapsed), 1000);
+	bus->util = (3 * bus->util + cur) / 4;
+	bus->win_start = now;
+	bus->win_busy = 0;
+}
+
+/*
+ * Whether low priority work on the bus, a poll or readahead, is to be
+ * shed because the bus is overloaded.
+ */
+static bool amzn_sfp_bus_shed(struct amzn_sfp_bus *bus, bool poll)
+{
+	int pct = READ_ONCE(amzn_sfp_bus_shed_pct);
+	bool shed;
+
+	if (bus == NULL || pct <= 0)
+		return false;
+	spin_lock_bh(&bus->lock);
+	amzn_sfp_bus_util(bus, ktime_get_ns());
+	shed = bus->util >= pct * 10;
+	if (shed && poll)
+		bus->shed_poll++;
+	else if (shed)
+		bus->shed_ra++;
+	spin_unlock_bh(&bus->lock);
+	return shed;
+}
+
+/*
+ * Every I2C transfer of the driver goes through here, so that its bus
+ * time can be charged to its owner, on the port and on the bus.  Called
+ * with the softc lock held.
+ */
+static int amzn_sfp_transfer(struct amzn_sfp_softc *sc, struct i2c_msg *msgs,
+    int nmsgs)
+{
+	const struct amzn_sfp_owner *owner = sc->owner;
+	struct amzn_sfp_bus *bus = sc->bus;
+	struct amzn_sfp_owner cur;
+	struct amzn_sfp_acct *a;
+	u64 start, now;
+	int error;
+
+	if (owner == NULL) {
+		if (current->flags & PF_KTHREAD)
+			owner = &amzn_sfp_owner_driver;
+		else {
+			amzn_sfp_owner_current(&cur);
+			owner = &cur;
+		}
+	}
+
+	start = ktime_get_ns();
+	error = i2c_transfer(sc->client->adapter, msgs, nmsgs);
+	now = ktime_get_ns();
+	trace_amzn_sfp_xfer(sc->port_id, msgs[0].addr, nmsgs, now - start,
+	    error);
+
+	a = amzn_sfp_acct_get(&sc->accts, &sc->nacct, owner, GFP_KERNEL);
+	if (a != NULL) {
+		a->xfers++;
+		a->bus_ns += now - start;
+	}
+	if (bus == NULL)
+		return error;
+	spin_lock_bh(&bus->lock);
+	bus->xfers++;
+	bus->busy_ns += now - start;
+	bus->win_busy += now - start;
+	amzn_sfp_bus_util(bus, now);
+	a = amzn_sfp_acct_get(&bus->accts, &bus->nacct, owner, GFP_ATOMIC);
+	if (a != NULL) {
+		a->xfers++;
+		a->bus_ns += now - start;
+		amzn_sfp_acct_refill(a, now);
+		a->tokens -= now - start;
+	}
+	spin_unlock_bh(&bus->lock);
+	return error;
+}
+
+/*
+ * How long, in ms, an owner has to wait to be within its bus time quota
+ * on a bus again; 0 if it is.  An owner that has to wait is counted as
+ * throttled.
+ */
+static unsigned int amzn_sfp_throttle_wait(struct amzn_sfp_bus *bus,
+    const struct amzn_sfp_owner *owner, int quota)
+{
+	struct amzn_sfp_acct *a;
+	s64 tokens = 0;
+
+	spin_lock_bh(&bus->lock);
+	list_for_each_entry(a, &bus->accts, link) {
+		if (a->owner.tgid != owner->tgid ||
+		    a->owner.cgroup != owner->cgroup)
+			continue;
+		amzn_sfp_acct_refill(a, ktime_get_ns());
+		tokens = a->tokens;
+		if (tokens < 0)
+			a->throttled++;
+		break;
+	}
+	spin_unlock_bh(&bus->lock);
+	if (tokens >= 0)
+		return 0;
+	/* The deficit in ns over the quota in us/s is the wait in ms. */
+	return div_u64(-tokens, quota) + 1;
+}
+
+/*
+ * Hold off the current process while it's over its bus time quota on
+ * the bus of the port.  Non-blocking callers get EAGAIN instead.
+ */
+static int amzn_sfp_throttle(struct amzn_sfp_softc *sc, struct file *fp)
+{
+	struct amzn_sfp_bus *bus = sc->bus;
+	struct amzn_sfp_owner owner;
+	unsigned int wait;
+	int quota;
+
+	if (bus == NULL || (current->flags & PF_KTHREAD))
+		return 0;
+	amzn_sfp_owner_current(&owner);
+	for (;;) {
+		quota = READ_ONCE(amzn_sfp_client_quota_us);
+		if (quota <= 0)
+			return 0;
+		wait = amzn_sfp_throttle_wait(bus, &owner, quota);
+		if (wait == 0)
+			return 0;
+
+		if (fp != NULL && (fp->f_flags & O_NONBLOCK))
+			return -EAGAIN;
+		if (msleep_interruptible(wait))
+			return -EINTR;
+	}
+}
+
+/*
+ * Perform a single access of at most one page (or half) of the EEPROM.
+ * The caller holds the softc lock and has validated the offset and
+ * length.  Returns the number of bytes transferred, which may be less
+ * than requested.  Once the port is removed, its client and adapter may
+ * be gone, so nothing reaches the bus anymore.
+ */
+static ssize_t amzn_sfp_rw_locked(struct amzn_sfp_softc *sc, char *buf,
+    loff_t ofs, size_t len, u16 flags)
+{
+	struct i2c_client *client = sc->client;
+	u8 *iobuf = sc->xfer_buf;
+	struct i2c_msg msg[2];
+	unsigned long ts;
+	int error, nmsgs;
+	size_t max;
+	u16 addr;
+	u8 reg;
+
+	if (sc->gone)
+		return -ENODEV;
+	addr = client->addr;
 
 	switch (sc->sfp_type) {
 	case AMZN_SFP_TYPE_SFP_PLUS:
+		/*
+		 * A module without usable A2h would only NAK or time out;
+		 * don't bother the bus.
+		 */
+		if (ofs >= AMZN_SFP_FULL_SIZE && sc->dm_valid &&
+		    !AMZN_SFF8472_HAS_A2(sc->dm_type))
+			return -ENXIO;
 		/*
 		 * Handle I2C address auto-increment for DOM access.
 		 * Never cross-over between different I2C addresses!
@@ -142,8 +1303,8 @@ static ssize_t amzn_sfp_rw(struct bin_attribute *ba, char *buf, loff_t ofs,
 		/* Upper half */
 
 		/* Prepare the buffer for writing page select. */
-		iobuf[0] = AMZN_QSFP_PAGE_SELECT;
-		iobuf[1] = (ofs / AMZN_SFP_HALF_SIZE) - 1;
+		iobuf[AMZN_SFP_XFER_SEL] = AMZN_QSFP_PAGE_SELECT;
+		iobuf[AMZN_SFP_XFER_SEL + 1] = (ofs / AMZN_SFP_HALF_SIZE) - 1;
 
 		/* Calculate the offset on the page. */
 		reg = (ofs % AMZN_SFP_HALF_SIZE) + AMZN_SFP_HALF_SIZE;
@@ -179,136 +1340,4147 @@ static ssize_t amzn_sfp_rw(struct bin_attribute *ba, char *buf, loff_t ofs,
 			/*
 			 * Read the page select register and update our
 			 * notion of the current page.  Read the value
-			 * in iobuf[2] to preserve the desired page in
-			 * iobuf[1].
+			 * into its own byte to preserve the desired
+			 * page.
 			 */
 			nmsgs = 0;
 			msg[nmsgs].addr = addr;
-			msg[nmsgs].flags = 0;
+			msg[nmsgs].flags = I2C_M_DMA_SAFE;
 			msg[nmsgs].len = 1;
-			msg[nmsgs].buf = &iobuf[0];
+			msg[nmsgs].buf = &iobuf[AMZN_SFP_XFER_SEL];
 			nmsgs++;
 			msg[nmsgs].addr = addr;
-			msg[nmsgs].flags = I2C_M_RD;
+			msg[nmsgs].flags = I2C_M_RD | I2C_M_DMA_SAFE;
 			msg[nmsgs].len = 1;
-			msg[nmsgs].buf = &iobuf[2];
+			msg[nmsgs].buf = &iobuf[AMZN_SFP_XFER_CUR];
 			nmsgs++;
 
-			error = i2c_transfer(client->adapter, msg, nmsgs);
+			error = amzn_sfp_transfer(sc, msg, nmsgs);
 			if (error < 0) {
 				/* Don't trust our state. */
 				sc->cur_page = -1;
-				rt_mutex_unlock(&sc->lock);
 				return error;
 			}
 
-			if (iobuf[2] != sc->cur_page) {
-				if (sc->cur_page != -1)
-					dev_notice(&sc->client->dev,
-					    "resetting current page to %u"
-					    " (was %u)\n", iobuf[2],
-					    sc->cur_page);
-				sc->cur_page = iobuf[2];
-			}
-			sc->cur_page_ts = jiffies;
-		}
+			if (iobuf[AMZN_SFP_XFER_CUR] != sc->cur_page) {
+				if (sc->cur_page != -1)
+					dev_notice(&sc->client->dev,
+					    "resetting current page to %u"
+					    " (was %u)\n",
+					    iobuf[AMZN_SFP_XFER_CUR],
+					    sc->cur_page);
+				sc->cur_page = iobuf[AMZN_SFP_XFER_CUR];
+			}
+			sc->cur_page_ts = jiffies;
+		}
+
+		/*
+		 * Don't write the page select register if the desired
+		 * page is the same as the current page.
+		 */
+		if (iobuf[AMZN_SFP_XFER_SEL + 1] == sc->cur_page)
+			break;
+
+		/*
+		 * Write the page select register.  We have a lock on
+		 * the device, so we know the page can not be changed
+		 * between now and when we access the page.
+		 */
+		nmsgs = 0;
+		msg[nmsgs].addr = addr;
+		msg[nmsgs].flags = I2C_M_DMA_SAFE;
+		msg[nmsgs].len = 2;
+		msg[nmsgs].buf = &iobuf[AMZN_SFP_XFER_SEL];
+		nmsgs++;
+
+		error = amzn_sfp_transfer(sc, msg, nmsgs);
+		if (error < 0) {
+			/* Don't trust our state. */
+			sc->cur_page = -1;
+			return error;
+		}
+
+		sc->cur_page = iobuf[AMZN_SFP_XFER_SEL + 1];
+		sc->cur_page_ts = jiffies;
+		break;
+	default:
+		/*
+		 * Unknown SFP type, we simply give access to the full
+		 * EEPROM, without any knowledge about.  You get what
+		 * you get...
+		 */
+		reg = ofs;
+		break;
+	}
+
+	/* Stay within what the adapter can handle in one go. */
+	max = (flags == I2C_M_RD) ? sc->max_xfer : sc->max_wxfer;
+	if (len > max)
+		len = max;
+
+	/*
+	 * Data moves through the transfer buffer, never through the
+	 * caller's buffer, which may be on the stack or in vmalloc space.
+	 */
+	nmsgs = 0;
+	iobuf[AMZN_SFP_XFER_REG] = reg;
+	if (flags == I2C_M_RD) {
+		msg[nmsgs].addr = addr;
+		msg[nmsgs].flags = I2C_M_DMA_SAFE;
+		msg[nmsgs].len = 1;
+		msg[nmsgs].buf = &iobuf[AMZN_SFP_XFER_REG];
+		nmsgs++;
+		msg[nmsgs].addr = addr;
+		msg[nmsgs].flags = flags | I2C_M_DMA_SAFE;
+		msg[nmsgs].len = len;
+		msg[nmsgs].buf = &iobuf[AMZN_SFP_XFER_DATA];
+		nmsgs++;
+	} else {
+		memcpy(&iobuf[AMZN_SFP_XFER_DATA], buf, len);
+		msg[nmsgs].addr = addr;
+		msg[nmsgs].flags = I2C_M_DMA_SAFE;
+		msg[nmsgs].len = len + 1;
+		msg[nmsgs].buf = &iobuf[AMZN_SFP_XFER_REG];
+		nmsgs++;
+	}
+	/* Writing to page select byte and immediate read to that same page 
+	 * cause certain modules to hang. Wait 4 - 5ms for modules to load 
+	 * upper page eeprom
+	 */
+	ts = sc->cur_page_ts + msecs_to_jiffies(amzn_sfp_page_load_wait_ms);
+	if (time_in_range(jiffies, sc->cur_page_ts, ts)) {
+		ts = amzn_sfp_page_load_wait_ms * 1000;
+		usleep_range(ts, ts + 1000);
+	}
+
+	error = amzn_sfp_transfer(sc, msg, nmsgs);
+	if (error < 0)
+		return error;
+	if (error != nmsgs)
+		return -EPIPE;
+	if (flags == I2C_M_RD)
+		memcpy(buf, &iobuf[AMZN_SFP_XFER_DATA], len);
+	return (ssize_t)len;
+}
+
+/*
+ * Return the kind of the range the byte at ofs is in and the end of
+ * that range.
+ */
+static int amzn_sfp_range_kind(struct amzn_sfp_softc *sc, loff_t ofs,
+    loff_t *endp)
+{
+	const struct amzn_sfp_backend *be = sc->backend;
+	const struct amzn_sfp_range *r;
+	unsigned int i;
+
+	*endp = sc->attr.size;
+	if (be == NULL)
+		return AMZN_SFP_RANGE_NOCACHE;
+
+	for (i = 0; i < be->nranges; i++) {
+		r = &be->ranges[i];
+		if (ofs < r->start) {
+			*endp = r->start;
+			break;
+		}
+		if (ofs < r->end) {
+			*endp = r->end;
+			return r->kind;
+		}
+	}
+	return AMZN_SFP_RANGE_VOLATILE;
+}
+
+/*
+ * The shadow cache is only used while we know which module is in the
+ * port.  Without presence polling, modules can be swapped under us.
+ */
+static bool amzn_sfp_cache_enabled(struct amzn_sfp_softc *sc)
+{
+
+	return sc->state == AMZN_SFP_STATE_READY ||
+	    sc->state == AMZN_SFP_STATE_IDENTIFYING;
+}
+
+static bool amzn_sfp_cache_fresh(struct amzn_sfp_cpage *cp, int kind)
+{
+
+	if (kind == AMZN_SFP_RANGE_STATIC)
+		return true;
+	return amzn_sfp_cache_ttl_ms > 0 && time_before(jiffies,
+	    cp->ts + msecs_to_jiffies(amzn_sfp_cache_ttl_ms));
+}
+
+/*
+ * Serve a read from the shadow cache.  Returns the number of bytes
+ * that could be served, which is 0 on a miss.  Like an access of the
+ * module, this never crosses a page.  Called with the softc lock held.
+ */
+static size_t amzn_sfp_cache_lookup(struct amzn_sfp_softc *sc, u8 *buf,
+    loff_t ofs, size_t len)
+{
+	struct amzn_sfp_cpage *cp;
+	unsigned int hofs;
+	loff_t end;
+	int kind;
+
+	if (!amzn_sfp_cache_enabled(sc))
+		return 0;
+	kind = amzn_sfp_range_kind(sc, ofs, &end);
+	if (kind == AMZN_SFP_RANGE_NOCACHE)
+		return 0;
+	cp = xa_load(&sc->cache, ofs / AMZN_SFP_HALF_SIZE);
+	if (cp == NULL || !amzn_sfp_cache_fresh(cp, kind))
+		return 0;
+
+	hofs = ofs % AMZN_SFP_HALF_SIZE;
+	len = min_t(size_t, len, end - ofs);
+	len = min_t(size_t, len, AMZN_SFP_HALF_SIZE - hofs);
+	len = find_next_zero_bit(cp->valid, hofs + len, hofs) - hofs;
+	memcpy(buf, cp->data + hofs, len);
+
+	if (len > 0 && !cp->pinned) {
+		spin_lock(&amzn_sfp_lru_lock);
+		list_move_tail(&cp->lru, &amzn_sfp_lru);
+		spin_unlock(&amzn_sfp_lru_lock);
+	}
+	return len;
+}
+
+/*
+ * Mirror a half of the shadow cache into the mmap-able image, if the
+ * port has one.  Pass NULL to invalidate the half.  Only halves of
+ * static data are mirrored: nothing ages volatile data out of the image.
+ * Called with the softc lock held.
+ */
+static void amzn_sfp_image_update(struct amzn_sfp_softc *sc,
+    unsigned int half, const struct amzn_sfp_cpage *cp)
+{
+	struct amzn_sfp_image_hdr *hdr = sc->image;
+	u8 *data;
+	bool full, valid;
+	u64 bit;
+
+	if (hdr == NULL || half >= sc->image_halves)
+		return;
+
+	data = (u8 *)hdr + AMZN_SFP_IMAGE_DATA + half * AMZN_SFP_HALF_SIZE;
+	bit = BIT_ULL(half % 64);
+	valid = (hdr->valid[half / 64] & bit) != 0;
+	full = (cp != NULL && cp->pinned &&
+	    bitmap_full(cp->valid, AMZN_SFP_HALF_SIZE));
+	if (!full && !valid)
+		return;
+	if (full && valid && !memcmp(data, cp->data, AMZN_SFP_HALF_SIZE))
+		return;
+
+	WRITE_ONCE(hdr->gen[half], hdr->gen[half] + 1);
+	smp_wmb();
+	if (full) {
+		memcpy(data, cp->data, AMZN_SFP_HALF_SIZE);
+		WRITE_ONCE(hdr->valid[half / 64], hdr->valid[half / 64] | bit);
+	} else
+		WRITE_ONCE(hdr->valid[half / 64], hdr->valid[half / 64] & ~bit);
+	smp_wmb();
+	WRITE_ONCE(hdr->gen[half], hdr->gen[half] + 1);
+}
+
+/*
+ * Evict up to nr pages from the head of the LRU list.  The port a page
+ * belongs to has to be locked to remove the page from its cache.  Ports
+ * that are busy are skipped, except for the port the caller has locked.
+ * Returns the number of pages evicted.
+ */
+static unsigned long amzn_sfp_cache_evict(unsigned long nr,
+    struct amzn_sfp_softc *locked)
+{
+	struct amzn_sfp_cpage *cp, *victim;
+	struct amzn_sfp_softc *sc;
+	unsigned long freed = 0;
+
+	while (freed < nr) {
+		victim = NULL;
+		spin_lock(&amzn_sfp_lru_lock);
+		list_for_each_entry(cp, &amzn_sfp_lru, lru) {
+			sc = cp->sc;
+			if (sc == locked || rt_mutex_trylock(&sc->lock)) {
+				victim = cp;
+				list_del_init(&cp->lru);
+				amzn_sfp_lru_count--;
+				break;
+			}
+		}
+		spin_unlock(&amzn_sfp_lru_lock);
+		if (victim == NULL)
+			break;
+
+		/* With the port locked, the page can't go away under us. */
+		xa_erase(&sc->cache, victim->half);
+		amzn_sfp_image_update(sc, victim->half, NULL);
+		kmem_cache_free(amzn_sfp_page_cache, victim->data);
+		kfree(victim);
+		if (sc != locked)
+			rt_mutex_unlock(&sc->lock);
+		freed++;
+	}
+	return freed;
+}
+
+static unsigned long amzn_sfp_shrink_count(struct shrinker *shrink,
+    struct shrink_control *ctl)
+{
+	unsigned long count = READ_ONCE(amzn_sfp_lru_count);
+
+	return (count != 0) ? count : SHRINK_EMPTY;
+}
+
+static unsigned long amzn_sfp_shrink_scan(struct shrinker *shrink,
+    struct shrink_control *ctl)
+{
+	unsigned long freed;
+
+	freed = amzn_sfp_cache_evict(ctl->nr_to_scan, NULL);
+	return (freed != 0) ? freed : SHRINK_STOP;
+}
+
+static struct shrinker amzn_sfp_shrinker = {
+	.count_objects = amzn_sfp_shrink_count,
+	.scan_objects = amzn_sfp_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+
+/*
+ * Allocate the mmap-able image of the port and populate it from the
+ * shadow cache.  Called with the softc lock held.
+ */
+static int amzn_sfp_image_alloc(struct amzn_sfp_softc *sc)
+{
+	struct amzn_sfp_image_hdr *hdr;
+	struct amzn_sfp_cpage *cp;
+	unsigned long half;
+
+	if (sc->image != NULL)
+		return 0;
+
+	hdr = vmalloc_user(PAGE_ALIGN(AMZN_SFP_IMAGE_DATA + sc->attr.size));
+	if (hdr == NULL)
+		return -ENOMEM;
+	hdr->magic = AMZN_SFP_IMAGE_MAGIC;
+	hdr->version = AMZN_SFP_IMAGE_VERSION;
+	hdr->halves = sc->attr.size / AMZN_SFP_HALF_SIZE;
+	hdr->data_offset = AMZN_SFP_IMAGE_DATA;
+	hdr->data_size = sc->attr.size;
+	sc->image_halves = hdr->halves;
+	sc->image = hdr;
+
+	xa_for_each(&sc->cache, half, cp)
+		amzn_sfp_image_update(sc, half, cp);
+	return 0;
+}
+
+/*
+ * Allocate a page for the shadow cache of the port.  Pages that only
+ * hold static data are pinned, all others go on the LRU list.  The
+ * number of those is bounded by amzn-sfp-cache-max-pages.  Called with
+ * the softc lock held.
+ */
+static struct amzn_sfp_cpage *amzn_sfp_cpage_alloc(struct amzn_sfp_softc *sc,
+    unsigned int half)
+{
+	struct amzn_sfp_cpage *cp;
+	loff_t end;
+	int kind;
+
+	kind = amzn_sfp_range_kind(sc, half * AMZN_SFP_HALF_SIZE, &end);
+	cp = kzalloc(sizeof(*cp), GFP_KERNEL);
+	if (cp == NULL)
+		return NULL;
+	cp->data = kmem_cache_alloc(amzn_sfp_page_cache, GFP_KERNEL);
+	if (cp->data == NULL) {
+		kfree(cp);
+		return NULL;
+	}
+	cp->sc = sc;
+	cp->half = half;
+	cp->pinned = (kind == AMZN_SFP_RANGE_STATIC &&
+	    end >= (half + 1) * AMZN_SFP_HALF_SIZE);
+	INIT_LIST_HEAD(&cp->lru);
+
+	if (xa_err(xa_store(&sc->cache, half, cp, GFP_KERNEL))) {
+		kmem_cache_free(amzn_sfp_page_cache, cp->data);
+		kfree(cp);
+		return NULL;
+	}
+
+	if (!cp->pinned) {
+		if (READ_ONCE(amzn_sfp_lru_count) >=
+		    max(amzn_sfp_cache_max_pages, 1))
+			amzn_sfp_cache_evict(1, sc);
+		spin_lock(&amzn_sfp_lru_lock);
+		list_add_tail(&cp->lru, &amzn_sfp_lru);
+		amzn_sfp_lru_count++;
+		spin_unlock(&amzn_sfp_lru_lock);
+	}
+	return cp;
+}
+
+/* Called with the softc lock held. */
+static void amzn_sfp_cpage_free(struct amzn_sfp_softc *sc,
+    struct amzn_sfp_cpage *cp)
+{
+
+	xa_erase(&sc->cache, cp->half);
+	if (!cp->pinned) {
+		spin_lock(&amzn_sfp_lru_lock);
+		if (!list_empty(&cp->lru)) {
+			list_del(&cp->lru);
+			amzn_sfp_lru_count--;
+		}
+		spin_unlock(&amzn_sfp_lru_lock);
+	}
+	kmem_cache_free(amzn_sfp_page_cache, cp->data);
+	kfree(cp);
+}
+
+/*
+ * Whether a page of the shadow cache holds volatile data, which is
+ * dropped when clear is set.  Called with the softc lock held.
+ */
+static bool amzn_sfp_cache_volatile(struct amzn_sfp_softc *sc,
+    struct amzn_sfp_cpage *cp, bool clear)
+{
+	loff_t base = (loff_t)cp->half * AMZN_SFP_HALF_SIZE;
+	loff_t ofs, end;
+	bool found = false;
+
+	if (cp->pinned)
+		return false;
+	for (ofs = base; ofs < base + AMZN_SFP_HALF_SIZE; ofs = end) {
+		if (amzn_sfp_range_kind(sc, ofs, &end) == AMZN_SFP_RANGE_STATIC)
+			continue;
+		end = min_t(loff_t, end, base + AMZN_SFP_HALF_SIZE);
+		if (find_next_bit(cp->valid, end - base, ofs - base) >=
+		    end - base)
+			continue;
+		found = true;
+		if (clear)
+			bitmap_clear(cp->valid, ofs - base, end - ofs);
+	}
+	return found;
+}
+
+/*
+ * Store what was read from the module in the shadow cache, as far as
+ * it's cacheable.  Called with the softc lock held.
+ */
+static void amzn_sfp_cache_fill(struct amzn_sfp_softc *sc, const u8 *buf,
+    loff_t ofs, size_t len)
+{
+	struct amzn_sfp_cpage *cp;
+	unsigned int half, hofs;
+	size_t count;
+	loff_t end;
+	int kind;
+
+	if (!amzn_sfp_cache_enabled(sc))
+		return;
+
+	while (len > 0) {
+		kind = amzn_sfp_range_kind(sc, ofs, &end);
+		half = ofs / AMZN_SFP_HALF_SIZE;
+		hofs = ofs % AMZN_SFP_HALF_SIZE;
+		count = min_t(size_t, len, end - ofs);
+		count = min_t(size_t, count, AMZN_SFP_HALF_SIZE - hofs);
+
+		if (kind == AMZN_SFP_RANGE_STATIC ||
+		    (kind == AMZN_SFP_RANGE_VOLATILE &&
+		    amzn_sfp_cache_ttl_ms > 0)) {
+			cp = xa_load(&sc->cache, half);
+			if (cp == NULL) {
+				cp = amzn_sfp_cpage_alloc(sc, half);
+				if (cp == NULL)
+					return;
+			}
+			/*
+			 * The volatile data of a page is as old as its oldest
+			 * byte, so the time is only set when there's none.
+			 * Stale data isn't mixed in; static data is kept.
+			 */
+			if (kind == AMZN_SFP_RANGE_VOLATILE &&
+			    (!amzn_sfp_cache_fresh(cp, kind) ||
+			    !amzn_sfp_cache_volatile(sc, cp, false))) {
+				amzn_sfp_cache_volatile(sc, cp, true);
+				cp->ts = jiffies;
+			}
+			memcpy(cp->data + hofs, buf, count);
+			bitmap_set(cp->valid, hofs, count);
+			amzn_sfp_image_update(sc, half, cp);
+		}
+
+		buf += count;
+		ofs += count;
+		len -= count;
+	}
+}
+
+/* Forget cached data after a write.  Called with the softc lock held. */
+static void amzn_sfp_cache_invalidate(struct amzn_sfp_softc *sc, loff_t ofs,
+    size_t len)
+{
+	struct amzn_sfp_cpage *cp;
+	unsigned int hofs;
+	size_t count;
+
+	while (len > 0) {
+		hofs = ofs % AMZN_SFP_HALF_SIZE;
+		count = min_t(size_t, len, AMZN_SFP_HALF_SIZE - hofs);
+		cp = xa_load(&sc->cache, ofs / AMZN_SFP_HALF_SIZE);
+		if (cp != NULL)
+			bitmap_clear(cp->valid, hofs, count);
+		amzn_sfp_image_update(sc, ofs / AMZN_SFP_HALF_SIZE, NULL);
+		ofs += count;
+		len -= count;
+	}
+}
+
+/*
+ * Empty the shadow cache and invalidate the image.  Called with the
+ * softc lock held.
+ */
+static void amzn_sfp_cache_flush(struct amzn_sfp_softc *sc)
+{
+	struct amzn_sfp_cpage *cp;
+	unsigned long half;
+
+	xa_for_each(&sc->cache, half, cp)
+		amzn_sfp_cpage_free(sc, cp);
+	for (half = 0; half < sc->image_halves; half++)
+		amzn_sfp_image_update(sc, half, NULL);
+}
+
+/*
+ * Read len bytes, crossing pages if needed, and keep the cache up to
+ * date.  Called with the softc lock held.
+ */
+static int amzn_sfp_read_locked(struct amzn_sfp_softc *sc, u8 *buf,
+    loff_t ofs, size_t len)
+{
+	ssize_t result;
+
+	while (len > 0) {
+		result = amzn_sfp_rw_locked(sc, buf, ofs, len, I2C_M_RD);
+		if (result < 0)
+			return result;
+		amzn_sfp_cache_fill(sc, buf, ofs, result);
+		buf += result;
+		ofs += result;
+		len -= result;
+	}
+	return 0;
+}
+
+/*
+ * Read len bytes through the shadow cache.  Called with the softc lock
+ * held.
+ */
+static int amzn_sfp_read_cached(struct amzn_sfp_softc *sc, u8 *buf,
+    loff_t ofs, size_t len)
+{
+	ssize_t result;
+
+	while (len > 0) {
+		result = amzn_sfp_cache_lookup(sc, buf, ofs, len);
+		if (result == 0) {
+			result = amzn_sfp_rw_locked(sc, buf, ofs, len,
+			    I2C_M_RD);
+			if (result < 0)
+				return result;
+			amzn_sfp_cache_fill(sc, buf, ofs, result);
+		}
+		buf += result;
+		ofs += result;
+		len -= result;
+	}
+	return 0;
+}
+
+/*
+ * Return whether the byte at ofs can be read ahead and if so, up to
+ * where (but not beyond the page).  Pages other than 00h don't exist
+ * on flat memory modules, so we don't go there.
+ */
+static bool amzn_sfp_ra_possible(struct amzn_sfp_softc *sc, loff_t ofs,
+    loff_t *endp)
+{
+	loff_t end;
+	int kind;
+
+	if (!amzn_sfp_cache_enabled(sc) || ofs >= sc->attr.size)
+		return false;
+	if (sc->flat_mem && ofs >= 2 * AMZN_SFP_HALF_SIZE)
+		return false;
+
+	kind = amzn_sfp_range_kind(sc, ofs, &end);
+	if (kind == AMZN_SFP_RANGE_NOCACHE ||
+	    (kind == AMZN_SFP_RANGE_VOLATILE && amzn_sfp_cache_ttl_ms <= 0))
+		return false;
+
+	*endp = min_t(loff_t, end, round_up(ofs + 1, AMZN_SFP_HALF_SIZE));
+	return true;
+}
+
+/*
+ * Find the readahead state of an open file, recycling the oldest slot
+ * for files we haven't seen (recently).  Called with the softc lock
+ * held.
+ */
+static struct amzn_sfp_ra *amzn_sfp_ra_get(struct amzn_sfp_softc *sc,
+    const struct file *fp)
+{
+	struct amzn_sfp_ra *ra;
+	unsigned int i;
+
+	for (i = 0; i < AMZN_SFP_RA_SLOTS; i++) {
+		if (sc->ra[i].fp == fp)
+			return &sc->ra[i];
+	}
+
+	ra = &sc->ra[sc->ra_next++ % AMZN_SFP_RA_SLOTS];
+	ra->fp = fp;
+	ra->next = -1;
+	ra->window = 0;
+	return ra;
+}
+
+/*
+ * Read from the module on behalf of a user.  A read that misses the
+ * cache fetches the rest of the page into the cache and is served from
+ * there, so that following small reads become memory hits.  Files that
+ * are read sequentially have the following pages read ahead as well,
+ * doubling the number of pages each time the cache is missed up to
+ * amzn-sfp-readahead-max-pages.  Called with the softc lock held.
+ */
+static ssize_t amzn_sfp_read_user(struct amzn_sfp_softc *sc,
+    struct file *fp, u8 *buf, loff_t ofs, size_t len)
+{
+	struct amzn_sfp_ra *ra = NULL;
+	u8 rabuf[AMZN_SFP_HALF_SIZE];
+	unsigned int window = 0;
+	loff_t end, next;
+	ssize_t result;
+
+	result = amzn_sfp_cache_lookup(sc, buf, ofs, len);
+	if (result > 0)
+		goto out;
+
+	if (!amzn_sfp_readahead || !amzn_sfp_ra_possible(sc, ofs, &end) ||
+	    amzn_sfp_bus_shed(sc->bus, false)) {
+		result = amzn_sfp_rw_locked(sc, buf, ofs, len, I2C_M_RD);
+		goto out;
+	}
+
+	if (fp != NULL) {
+		ra = amzn_sfp_ra_get(sc, fp);
+		/* A maximum of 0 turns read ahead of pages off. */
+		if (ofs == ra->next)
+			ra->window = min(max(2 * ra->window, 1U),
+			    (unsigned int)max(amzn_sfp_readahead_max_pages, 0));
+		else
+			ra->window = 0;
+		window = ra->window;
+	}
+
+	/* Fill the rest of the page. */
+	result = amzn_sfp_read_locked(sc, rabuf, ofs, end - ofs);
+	if (result < 0)
+		goto out;
+	result = min_t(size_t, len, end - ofs);
+	memcpy(buf, rabuf, result);
+
+	/* And the pages after it, for sequential readers. */
+	next = round_up(ofs + 1, AMZN_SFP_HALF_SIZE);
+	while (window-- > 0 && amzn_sfp_ra_possible(sc, next, &end)) {
+		if (amzn_sfp_cache_lookup(sc, rabuf, next, end - next) <
+		    end - next) {
+			if (amzn_sfp_read_locked(sc, rabuf, next, end - next))
+				break;
+		}
+		next += AMZN_SFP_HALF_SIZE;
+	}
+
+ out:
+	if (result > 0 && fp != NULL) {
+		if (ra == NULL)
+			ra = amzn_sfp_ra_get(sc, fp);
+		ra->next = ofs + result;
+	}
+	return result;
+}
+
+static void amzn_sfp_id_string(char *dst, const u8 *src, size_t len)
+{
+
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+	while (len > 0 && (dst[len - 1] == ' ' || dst[len - 1] == '\0'))
+		dst[--len] = '\0';
+}
+
+/*
+ * Read the identity page and extract the identity information from it.
+ * The identity page ends up in the shadow cache, so that later reads of
+ * it by users don't go to the module.  Called with the softc lock held.
+ */
+static int amzn_sfp_identify(struct amzn_sfp_softc *sc)
+{
+	const struct amzn_sfp_backend *be = sc->backend;
+	const struct amzn_sfp_id_layout *layout;
+	struct amzn_sfp_ident *id = &sc->ident;
+	u8 page[AMZN_SFP_HALF_SIZE];
+	u8 status, rev[2];
+	int error;
+
+	if (be == NULL)
+		return -ENODEV;
+	layout = be->id_layout;
+
+	error = amzn_sfp_read_locked(sc, page, be->id_offset, sizeof(page));
+	if (error)
+		return error;
+
+	/* The identifier is the first byte of the identity page. */
+	id->identifier = page[0];
+	amzn_sfp_id_string(id->vendor_name, page + layout->vendor_name, 16);
+	amzn_sfp_id_string(id->vendor_pn, page + layout->vendor_pn, 16);
+	amzn_sfp_id_string(id->vendor_rev, page + layout->vendor_rev,
+	    layout->vendor_rev_len);
+	amzn_sfp_id_string(id->vendor_sn, page + layout->vendor_sn, 16);
+	amzn_sfp_id_string(id->date_code, page + layout->date_code, 8);
+	id->fingerprint = crc32(0, page, sizeof(page));
+
+	/* Learn whether the module has upper pages other than 00h. */
+	sc->flat_mem = false;
+	sc->cmis_rev = 0;
+	switch (sc->sfp_type) {
+	case AMZN_SFP_TYPE_SFP_PLUS:
+		sc->dm_type = page[AMZN_SFF8472_DIAG_TYPE];
+		sc->dm_valid = true;
+		if (sc->dm_type & AMZN_SFF8472_DIAG_ADDR_CHANGE)
+			dev_info(&sc->client->dev,
+			    "A2h needs an address change; not accessing it\n");
+		break;
+	case AMZN_SFP_TYPE_QSFP_PLUS:
+	case AMZN_SFP_TYPE_QSFP28:
+		error = amzn_sfp_read_locked(sc, &status, AMZN_SFF8636_STATUS,
+		    1);
+		if (error)
+			return error;
+		sc->flat_mem = (status & AMZN_SFF8636_FLAT_MEM) != 0;
+		break;
+	case AMZN_SFP_TYPE_QSFP_DD:
+		error = amzn_sfp_read_locked(sc, rev, AMZN_CMIS_REV, 2);
+		if (error)
+			return error;
+		sc->cmis_rev = rev[0];
+		sc->flat_mem = (rev[1] & AMZN_CMIS_FLAT_MEM) != 0;
+		break;
+	}
+
+	sc->id_valid = true;
+	return 0;
+}
+
+/*
+ * Wait for a freshly inserted module to become ready and identified.
+ * Returns 0 when the module can be accessed and EAGAIN when it's still
+ * initializing after the wait (or right away for non-blocking files).
+ */
+static int amzn_sfp_wait_ready(struct amzn_sfp_softc *sc, struct file *fp)
+{
+	long timo;
+
+	switch (READ_ONCE(sc->state)) {
+	case AMZN_SFP_STATE_ABSENT:
+		return -ENXIO;
+	case AMZN_SFP_STATE_NOT_READY:
+	case AMZN_SFP_STATE_IDENTIFYING:
+		break;
+	default:
+		return 0;
+	}
+
+	if ((fp != NULL && (fp->f_flags & O_NONBLOCK)) ||
+	    amzn_sfp_ready_wait_ms <= 0)
+		return -EAGAIN;
+
+	timo = wait_event_interruptible_timeout(sc->state_wq,
+	    READ_ONCE(sc->state) != AMZN_SFP_STATE_NOT_READY &&
+	    READ_ONCE(sc->state) != AMZN_SFP_STATE_IDENTIFYING,
+	    msecs_to_jiffies(amzn_sfp_ready_wait_ms));
+	if (timo < 0)
+		return timo;
+	if (timo == 0)
+		return -EAGAIN;
+	return (READ_ONCE(sc->state) == AMZN_SFP_STATE_ABSENT) ? -ENXIO : 0;
+}
+
+static ssize_t amzn_sfp_rw(struct bin_attribute *ba, struct file *fp,
+    char *buf, loff_t ofs, size_t len, u16 flags)
+{
+	struct amzn_sfp_softc *sc = ba->private;
+	ssize_t result;
+	int error, op;
+
+	/* Make sure the offset and length are valid. */
+	if (ofs < 0 || ofs >= ba->size)
+		return -ESPIPE;
+	if (len == 0)
+		return -EINVAL;
+	if (ofs + len > ba->size)
+		return -ENOSPC;
+
+	/*
+	 * Reads from a module that's still initializing return garbage
+	 * or get NAK-ed.  Hold them off until the module says it's ready.
+	 * Writes go through, because the host may have to write to the
+	 * module to get it out of its low power state.
+	 */
+	if (flags == I2C_M_RD) {
+		error = amzn_sfp_wait_ready(sc, fp);
+		if (error)
+			return error;
+	}
+	op = (flags == I2C_M_RD) ? AMZN_SFP_OP_READ : AMZN_SFP_OP_WRITE;
+	trace_amzn_sfp_request(sc->port_id, op, ofs, len);
+	error = amzn_sfp_throttle(sc, fp);
+	if (error) {
+		trace_amzn_sfp_request_done(sc->port_id, op, ofs, error);
+		return error;
+	}
+
+	rt_mutex_lock(&sc->lock);
+	if (flags == I2C_M_RD) {
+		result = amzn_sfp_read_user(sc, fp, buf, ofs, len);
+	} else {
+		result = amzn_sfp_rw_locked(sc, buf, ofs, len, flags);
+		if (result > 0)
+			amzn_sfp_cache_invalidate(sc, ofs, result);
+	}
+	rt_mutex_unlock(&sc->lock);
+	trace_amzn_sfp_request_done(sc->port_id, op, ofs, result);
+	return result;
+}
+
+/*
+ * Readiness of modules.  Each reads the readiness register(s) of the
+ * module and returns the corresponding module state.  Called with the
+ * softc lock held.
+ */
+static int amzn_sff8472_probe_state(struct amzn_sfp_softc *sc)
+{
+	ssize_t result;
+	u8 val;
+
+	result = amzn_sfp_rw_locked(sc, &val, AMZN_SFF8472_DIAG_TYPE, 1,
+	    I2C_M_RD);
+	if (result < 0)
+		return AMZN_SFP_STATE_ABSENT;
+	/* Readiness is in A2h, which not every module lets us access. */
+	sc->dm_type = val;
+	sc->dm_valid = true;
+	if (!AMZN_SFF8472_HAS_A2(val))
+		return AMZN_SFP_STATE_READY;
+	result = amzn_sfp_rw_locked(sc, &val, AMZN_SFF8472_STATUS, 1,
+	    I2C_M_RD);
+	if (result < 0 || (val & AMZN_SFF8472_DATA_READY_BAR))
+		return AMZN_SFP_STATE_NOT_READY;
+	return AMZN_SFP_STATE_READY;
+}
+
+static int amzn_sff8636_probe_state(struct amzn_sfp_softc *sc)
+{
+	ssize_t result;
+	u8 val;
+
+	result = amzn_sfp_rw_locked(sc, &val, AMZN_SFF8636_STATUS, 1,
+	    I2C_M_RD);
+	if (result < 0)
+		return AMZN_SFP_STATE_ABSENT;
+	return (val & AMZN_SFF8636_DATA_NOT_READY) ?
+	    AMZN_SFP_STATE_NOT_READY : AMZN_SFP_STATE_READY;
+}
+
+static int amzn_cmis_probe_state(struct amzn_sfp_softc *sc)
+{
+	ssize_t result;
+	int mstate;
+	u8 val;
+
+	result = amzn_sfp_rw_locked(sc, &val, AMZN_CMIS_MODULE_STATE, 1,
+	    I2C_M_RD);
+	if (result < 0)
+		return AMZN_SFP_STATE_ABSENT;
+
+	/*
+	 * The management interface is fully functional in the steady
+	 * states, including ModuleLowPwr.  The host has to be able to
+	 * read the module in ModuleLowPwr to decide whether to power it
+	 * up.  Anything else means the module is still initializing or
+	 * transitioning.
+	 */
+	mstate = (val & AMZN_CMIS_MODULE_STATE_MASK) >>
+	    AMZN_CMIS_MODULE_STATE_SHIFT;
+	switch (mstate) {
+	case AMZN_CMIS_MODULE_LOWPWR:
+	case AMZN_CMIS_MODULE_READY:
+	case AMZN_CMIS_MODULE_FAULT:
+		return AMZN_SFP_STATE_READY;
+	default:
+		return AMZN_SFP_STATE_NOT_READY;
+	}
+}
+
+static int amzn_sfp_probe_state(struct amzn_sfp_softc *sc)
+{
+	ssize_t result;
+	u8 val;
+
+	if (sc->backend != NULL)
+		return sc->backend->probe_state(sc);
+
+	result = amzn_sfp_rw_locked(sc, &val, 0, 1, I2C_M_RD);
+	return (result < 0) ? AMZN_SFP_STATE_ABSENT : AMZN_SFP_STATE_READY;
+}
+
+static const struct amzn_sfp_backend amzn_sff8472_backend = {
+	.name = "sff8472",
+	.id_offset = 0,
+	.id_layout = &amzn_sff8472_id_layout,
+	.ranges = amzn_sff8472_ranges,
+	.nranges = ARRAY_SIZE(amzn_sff8472_ranges),
+	.diag = amzn_sff8472_diag,
+	.ndiag = ARRAY_SIZE(amzn_sff8472_diag),
+	.probe_state = amzn_sff8472_probe_state,
+};
+
+static const struct amzn_sfp_backend amzn_sff8636_backend = {
+	.name = "sff8636",
+	.id_offset = AMZN_SFP_HALF_SIZE,
+	.id_layout = &amzn_sff8636_id_layout,
+	.ranges = amzn_sff8636_ranges,
+	.nranges = ARRAY_SIZE(amzn_sff8636_ranges),
+	.diag = amzn_sff8636_diag,
+	.ndiag = ARRAY_SIZE(amzn_sff8636_diag),
+	.masks = amzn_sff8636_masks,
+	.nmasks = ARRAY_SIZE(amzn_sff8636_masks),
+	.summaries = amzn_sff8636_summaries,
+	.nsummaries = ARRAY_SIZE(amzn_sff8636_summaries),
+	.lane_mons = amzn_sff8636_lane_mons,
+	.nlane_mons = ARRAY_SIZE(amzn_sff8636_lane_mons),
+	.nlanes = 4,
+	.probe_state = amzn_sff8636_probe_state,
+};
+
+static const struct amzn_sfp_backend amzn_cmis_backend = {
+	.name = "cmis",
+	.id_offset = AMZN_SFP_HALF_SIZE,
+	.id_layout = &amzn_cmis_id_layout,
+	.ranges = amzn_cmis_ranges,
+	.nranges = ARRAY_SIZE(amzn_cmis_ranges),
+	.diag = amzn_cmis_diag,
+	.ndiag = ARRAY_SIZE(amzn_cmis_diag),
+	.masks = amzn_cmis_masks,
+	.nmasks = ARRAY_SIZE(amzn_cmis_masks),
+	.summaries = amzn_cmis_summaries,
+	.nsummaries = ARRAY_SIZE(amzn_cmis_summaries),
+	.lane_mons = amzn_cmis_lane_mons,
+	.nlane_mons = ARRAY_SIZE(amzn_cmis_lane_mons),
+	.nlanes = 8,
+	.probe_state = amzn_cmis_probe_state,
+};
+
+static const char * const amzn_sfp_state_names[] = {
+	[AMZN_SFP_STATE_UNKNOWN] = "unknown",
+	[AMZN_SFP_STATE_ABSENT] = "absent",
+	[AMZN_SFP_STATE_NOT_READY] = "not-ready",
+	[AMZN_SFP_STATE_IDENTIFYING] = "identifying",
+	[AMZN_SFP_STATE_READY] = "ready",
+};
+
+/* Multicast groups, in the order of the commands. */
+static const struct genl_multicast_group amzn_sfp_mcgrps[] = {
+	{ .name = AMZN_SFP_MCGRP_INSERT },
+	{ .name = AMZN_SFP_MCGRP_REMOVE },
+	{ .name = AMZN_SFP_MCGRP_READY },
+	{ .name = AMZN_SFP_MCGRP_IDENTITY },
+	{ .name = AMZN_SFP_MCGRP_ALARM },
+	{ .name = AMZN_SFP_MCGRP_THRESHOLD },
+};
+
+static struct genl_family amzn_sfp_genl = {
+	.name = AMZN_SFP_GENL_NAME,
+	.version = AMZN_SFP_GENL_VERSION,
+	.maxattr = AMZN_SFP_ATTR_MAX,
+	.module = THIS_MODULE,
+	.mcgrps = amzn_sfp_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(amzn_sfp_mcgrps),
+};
+
+/*
+ * Start a netlink message for an event of the port, with the attributes
+ * every message has.  Returns NULL when nobody listens to the group of
+ * the event, or when the message can't be had.
+ */
+static struct sk_buff *amzn_sfp_genl_start(struct amzn_sfp_softc *sc,
+    u8 cmd, void **hdrp)
+{
+	struct sk_buff *skb;
+	void *hdr;
+
+	if (!genl_has_listeners(&amzn_sfp_genl, &init_net, cmd - 1))
+		return NULL;
+	skb = genlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (skb == NULL)
+		return NULL;
+	hdr = genlmsg_put(skb, 0, 0, &amzn_sfp_genl, 0, cmd);
+	if (hdr == NULL ||
+	    nla_put_u32(skb, AMZN_SFP_ATTR_PORT, sc->port_id) ||
+	    nla_put_string(skb, AMZN_SFP_ATTR_DEVICE,
+	    dev_name(&sc->client->dev)) ||
+	    nla_put_u64_64bit(skb, AMZN_SFP_ATTR_TIMESTAMP, ktime_get_ns(),
+	    AMZN_SFP_ATTR_PAD)) {
+		nlmsg_free(skb);
+		return NULL;
+	}
+	*hdrp = hdr;
+	return skb;
+}
+
+static void amzn_sfp_genl_send(struct sk_buff *skb, void *hdr, u8 cmd)
+{
+
+	genlmsg_end(skb, hdr);
+	genlmsg_multicast(&amzn_sfp_genl, skb, 0, cmd - 1, GFP_KERNEL);
+}
+
+static void amzn_sfp_genl_state(struct amzn_sfp_softc *sc, u8 cmd,
+    int state)
+{
+	struct sk_buff *skb;
+	void *hdr;
+
+	skb = amzn_sfp_genl_start(sc, cmd, &hdr);
+	if (skb == NULL)
+		return;
+	if (nla_put_string(skb, AMZN_SFP_ATTR_STATE,
+	    amzn_sfp_state_names[state])) {
+		nlmsg_free(skb);
+		return;
+	}
+	amzn_sfp_genl_send(skb, hdr, cmd);
+}
+
+static void amzn_sfp_genl_identity(struct amzn_sfp_softc *sc)
+{
+	const struct amzn_sfp_ident *id = &sc->ident;
+	struct sk_buff *skb;
+	void *hdr;
+
+	skb = amzn_sfp_genl_start(sc, AMZN_SFP_CMD_IDENTITY, &hdr);
+	if (skb == NULL)
+		return;
+	if (nla_put_u8(skb, AMZN_SFP_ATTR_IDENTIFIER, id->identifier) ||
+	    nla_put_string(skb, AMZN_SFP_ATTR_VENDOR_NAME, id->vendor_name) ||
+	    nla_put_string(skb, AMZN_SFP_ATTR_VENDOR_PN, id->vendor_pn) ||
+	    nla_put_string(skb, AMZN_SFP_ATTR_VENDOR_SN, id->vendor_sn) ||
+	    nla_put_u32(skb, AMZN_SFP_ATTR_FINGERPRINT, id->fingerprint)) {
+		nlmsg_free(skb);
+		return;
+	}
+	amzn_sfp_genl_send(skb, hdr, AMZN_SFP_CMD_IDENTITY);
+}
+
+/* Hand listeners the latched flags of a sample. */
+static void amzn_sfp_genl_alarm(struct amzn_sfp_softc *sc,
+    const struct amzn_sfp_sample *smp)
+{
+	const struct amzn_sfp_backend *be = sc->backend;
+	const struct amzn_sfp_range *r;
+	const u8 *data = smp->data;
+	struct sk_buff *skb;
+	struct nlattr *nla;
+	unsigned int i, len;
+	void *hdr;
+	u8 *p;
+
+	skb = amzn_sfp_genl_start(sc, AMZN_SFP_CMD_ALARM, &hdr);
+	if (skb == NULL)
+		return;
+	len = 0;
+	for (i = 0; i < be->ndiag; i++) {
+		r = &be->diag[i];
+		if (r->kind == AMZN_SFP_RANGE_NOCACHE)
+			len += r->end - r->start;
+	}
+	nla = nla_reserve(skb, AMZN_SFP_ATTR_FLAGS, len);
+	if (nla == NULL) {
+		nlmsg_free(skb);
+		return;
+	}
+	p = nla_data(nla);
+	for (i = 0; i < be->ndiag; i++) {
+		r = &be->diag[i];
+		if (r->kind == AMZN_SFP_RANGE_NOCACHE) {
+			memcpy(p, data, r->end - r->start);
+			p += r->end - r->start;
+		}
+		data += r->end - r->start;
+	}
+	amzn_sfp_genl_send(skb, hdr, AMZN_SFP_CMD_ALARM);
+}
+
+static void amzn_sfp_set_state(struct amzn_sfp_softc *sc, int state)
+{
+	char event[32];
+	char *envp[] = { event, NULL };
+	int old;
+
+	old = sc->state;
+	if (state == old)
+		return;
+
+	/*
+	 * A new module may be sitting on a different page than the old
+	 * one.  Forget what we know about the current page.
+	 */
+	if (old == AMZN_SFP_STATE_ABSENT || state == AMZN_SFP_STATE_ABSENT)
+		sc->cur_page = -1;
+
+	/* The history of a module leaves with it. */
+	if (state == AMZN_SFP_STATE_ABSENT) {
+		sc->dm_valid = false;
+		sc->hist_count = 0;
+		sc->pm_unsupported = false;
+		sc->pm_failures = 0;
+		sc->pm_ts = 0;
+		/* The diagnostic task ends the session. */
+		if (sc->diag_active)
+			sc->diag_status = -ENXIO;
+	}
+
+	/*
+	 * Only a ready module has a known identity.  Whatever we cached
+	 * may not apply to the module once it's (re)identified.
+	 */
+	if (state != AMZN_SFP_STATE_READY) {
+		sc->id_valid = false;
+		amzn_sfp_cache_flush(sc);
+	}
+
+	WRITE_ONCE(sc->state, state);
+	wake_up_all(&sc->state_wq);
+
+	sysfs_notify(&sc->client->dev.kobj, NULL, "state");
+	snprintf(event, sizeof(event), "SFP_STATE=%s",
+	    amzn_sfp_state_names[state]);
+	kobject_uevent_env(&sc->client->dev.kobj, KOBJ_CHANGE, envp);
+
+	if (state == AMZN_SFP_STATE_ABSENT && old != AMZN_SFP_STATE_UNKNOWN)
+		amzn_sfp_genl_state(sc, AMZN_SFP_CMD_REMOVE, state);
+	else if (old == AMZN_SFP_STATE_ABSENT ||
+	    (old == AMZN_SFP_STATE_UNKNOWN && state != AMZN_SFP_STATE_ABSENT))
+		amzn_sfp_genl_state(sc, AMZN_SFP_CMD_INSERT, state);
+	if (state == AMZN_SFP_STATE_READY)
+		amzn_sfp_genl_state(sc, AMZN_SFP_CMD_READY, state);
+}
+
+/*
+ * Arm the bus worker to run at the given time, unless it's already set
+ * to run earlier.  Called with the bus lock held.
+ */
+static void amzn_sfp_bus_arm(struct amzn_sfp_bus *bus, unsigned long due)
+{
+	unsigned long now = jiffies;
+
+	if (delayed_work_pending(&bus->work) &&
+	    time_before_eq(bus->next_due, due))
+		return;
+	bus->next_due = due;
+	mod_delayed_work(amzn_sfp_wq, &bus->work,
+	    time_after(due, now) ? due - now : 0);
+}
+
+/* Schedule a task on the port to run after the given delay. */
+static void amzn_sfp_task_schedule(struct amzn_sfp_softc *sc, int task,
+    unsigned long delay)
+{
+	struct amzn_sfp_bus *bus = sc->bus;
+	unsigned long due = jiffies + delay;
+
+	spin_lock_bh(&bus->lock);
+	if (!test_bit(task, &sc->tasks) ||
+	    time_before(due, sc->task_due[task])) {
+		sc->task_due[task] = due;
+		__set_bit(task, &sc->tasks);
+	}
+	amzn_sfp_bus_arm(bus, sc->task_due[task]);
+	spin_unlock_bh(&bus->lock);
+}
+
+/* Whether the PM pages of the module are to be collected. */
+static bool amzn_sfp_pm_enabled(struct amzn_sfp_softc *sc)
+{
+
+	return READ_ONCE(amzn_sfp_pm_ms) > 0 &&
+	    sc->backend == &amzn_cmis_backend && !sc->flat_mem &&
+	    !sc->pm_unsupported;
+}
+
+/*
+ * Poll module presence and readiness.  A module that's present, but not
+ * ready, is polled with an exponential back-off starting at 10ms, so
+ * that we notice readiness quickly without hammering the bus.  A module
+ * that became ready gets queued for identification.  Ready and absent
+ * modules are polled at the presence poll interval.
+ */
+static void amzn_sfp_task_state(struct amzn_sfp_softc *sc)
+{
+	unsigned int delay;
+	int old, state;
+
+	if (amzn_sfp_presence_poll_ms <= 0) {
+		/* Polling disabled; pass everything through. */
+		rt_mutex_lock(&sc->lock);
+		amzn_sfp_set_state(sc, AMZN_SFP_STATE_UNKNOWN);
+		rt_mutex_unlock(&sc->lock);
+		amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_PRESENCE, HZ);
+		return;
+	}
+
+	rt_mutex_lock(&sc->lock);
+	old = sc->state;
+	/*
+	 * With a presence provider, the module is only asked about its
+	 * readiness after it was inserted.
+	 */
+	if (sc->prov != NULL && !READ_ONCE(sc->prov_present))
+		state = AMZN_SFP_STATE_ABSENT;
+	else if (sc->prov != NULL && old == AMZN_SFP_STATE_READY)
+		state = AMZN_SFP_STATE_READY;
+	else
+		state = amzn_sfp_probe_state(sc);
+	/* A ready module is identified before being reported ready. */
+	if (state == AMZN_SFP_STATE_READY && old != AMZN_SFP_STATE_READY)
+		state = AMZN_SFP_STATE_IDENTIFYING;
+	amzn_sfp_set_state(sc, state);
+	rt_mutex_unlock(&sc->lock);
+
+	if (state == AMZN_SFP_STATE_NOT_READY) {
+		delay = sc->ready_poll_ms;
+		sc->ready_poll_ms = min(2 * delay, AMZN_SFP_READY_POLL_MAX);
+		amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_READY,
+		    msecs_to_jiffies(delay));
+		return;
+	}
+
+	sc->ready_poll_ms = AMZN_SFP_READY_POLL_MIN;
+	if (state == AMZN_SFP_STATE_IDENTIFYING &&
+	    old != AMZN_SFP_STATE_IDENTIFYING) {
+		sc->ident_tries = 0;
+		amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_IDENTIFY, 0);
+	}
+	amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_PRESENCE,
+	    msecs_to_jiffies(amzn_sfp_presence_poll_ms));
+	if (READ_ONCE(amzn_sfp_history_ms) > 0)
+		amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_HISTORY,
+		    msecs_to_jiffies(amzn_sfp_history_ms));
+	if (state == AMZN_SFP_STATE_READY && amzn_sfp_pm_enabled(sc))
+		amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_PM,
+		    msecs_to_jiffies(amzn_sfp_pm_ms));
+}
+
+/* The flags of a flag byte that any client subscribed to. */
+static u8 amzn_sfp_flags_wanted(struct amzn_sfp_softc *sc, u32 ofs)
+{
+	struct amzn_sfp_flags *fs;
+	struct amzn_sfp_client *cl;
+	unsigned int k;
+	u8 bits = 0;
+
+	list_for_each_entry(cl, &sc->clients, link) {
+		for (k = 0; k < cl->nflag_subs; k++) {
+			fs = &cl->flag_subs[k];
+			if (ofs >= fs->offset && ofs < fs->offset + fs->length)
+				bits |= fs->bits[ofs - fs->offset];
+		}
+	}
+	return bits;
+}
+
+/*
+ * Program the interrupt masks of the module from the union of the flags
+ * that clients subscribed to.  Only mask bytes that changed are written,
+ * unless force is set, as for a module that was just (re)initialized and
+ * forgot its masks.  When the last subscription goes, the masks are set
+ * back to their default of 0.  Called with the softc lock held.
+ */
+static int amzn_sfp_masks_apply(struct amzn_sfp_softc *sc, bool force)
+{
+	const struct amzn_sfp_backend *be = sc->backend;
+	const struct amzn_sfp_mask_map *m;
+	u8 masks[AMZN_SFP_MAX_MASKS];
+	unsigned int i, j, n;
+	bool any, dirty;
+	ssize_t result;
+	u8 bits;
+
+	if (be == NULL || be->nmasks == 0)
+		return 0;
+
+	any = false;
+	n = 0;
+	for (i = 0; i < be->nmasks; i++) {
+		m = &be->masks[i];
+		for (j = 0; j < m->count; j++, n++) {
+			bits = amzn_sfp_flags_wanted(sc, m->flags + j);
+			if (bits)
+				any = true;
+			masks[n] = ~bits;
+		}
+	}
+	if (!any) {
+		if (!sc->masks_set || force) {
+			sc->masks_set = false;
+			return 0;
+		}
+		memset(masks, 0, n);
+	}
+
+	n = 0;
+	for (i = 0; i < be->nmasks; i++, n += m->count) {
+		m = &be->masks[i];
+		/* Modules without pages only have lower page masks. */
+		if (sc->flat_mem && m->masks >= AMZN_SFP_PAGE(0x01))
+			continue;
+		dirty = force || !sc->masks_set;
+		for (j = 0; j < m->count && !dirty; j++)
+			dirty = masks[n + j] != sc->int_masks[n + j];
+		if (!dirty)
+			continue;
+		result = amzn_sfp_rw_locked(sc, masks + n, m->masks, m->count,
+		    0);
+		if (result < 0)
+			return result;
+		if (result != m->count)
+			return -EIO;
+		amzn_sfp_cache_invalidate(sc, m->masks, m->count);
+	}
+	memcpy(sc->int_masks, masks, n);
+	sc->masks_set = any;
+	return 0;
+}
+
+/*
+ * Identify a freshly inserted module.  This happens exactly once per
+ * insertion, after which readers blocked on the module are released.
+ */
+static void amzn_sfp_task_identify(struct amzn_sfp_softc *sc)
+{
+	int error;
+
+	rt_mutex_lock(&sc->lock);
+	if (sc->state != AMZN_SFP_STATE_IDENTIFYING) {
+		/* Removed or reset in the meantime. */
+		rt_mutex_unlock(&sc->lock);
+		return;
+	}
+
+	error = amzn_sfp_identify(sc);
+	if (error && ++sc->ident_tries < AMZN_SFP_IDENT_TRIES) {
+		rt_mutex_unlock(&sc->lock);
+		amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_IDENTIFY,
+		    msecs_to_jiffies(100 * sc->ident_tries));
+		return;
+	}
+	if (error)
+		dev_warn(&sc->client->dev,
+		    "unable to identify module (error %d)\n", error);
+
+	/* A module that was just inserted or reset has default masks. */
+	if (!error) {
+		amzn_sfp_masks_apply(sc, true);
+		amzn_sfp_genl_identity(sc);
+	}
+
+	/* Don't hold readers off forever; they get what they get. */
+	amzn_sfp_set_state(sc, AMZN_SFP_STATE_READY);
+	rt_mutex_unlock(&sc->lock);
+}
+
+static void amzn_sfp_gather_release(struct kref *ref)
+{
+	struct amzn_sfp_gather_req *req = container_of(ref,
+	    struct amzn_sfp_gather_req, ref);
+
+	kvfree(req->results);
+	kfree(req);
+}
+
+static void amzn_sfp_gather_complete(struct amzn_sfp_gather_item *item,
+    int status)
+{
+	struct amzn_sfp_gather_req *req = item->req;
+
+	item->res->status = status;
+	if (item->res->timestamp == 0)
+		item->res->timestamp = ktime_get_ns();
+	if (atomic_dec_and_test(&req->pending))
+		complete(&req->done);
+	kref_put(&req->ref, amzn_sfp_gather_release);
+}
+
+/*
+ * Serve the gather requests queued on the port.  Modules that are not
+ * ready are not waited for; the issuer gets EAGAIN for them instead.
+ * Rounds due later than the next tick are put back; those due sooner
+ * are waited for, so that their reads start on time.
+ */
+static void amzn_sfp_task_gather(struct amzn_sfp_softc *sc)
+{
+	struct amzn_sfp_gather_item *item, *tmp;
+	struct amzn_sfp_gather_req *req;
+	LIST_HEAD(items);
+	LIST_HEAD(later);
+	u64 now, next = 0;
+	int error;
+
+	spin_lock_bh(&sc->bus->lock);
+	list_splice_init(&sc->gather_items, &items);
+	spin_unlock_bh(&sc->bus->lock);
+
+	list_for_each_entry_safe(item, tmp, &items, link) {
+		list_del(&item->link);
+		req = item->req;
+
+		if (req->offset + req->length > sc->attr.size) {
+			amzn_sfp_gather_complete(item, -ESPIPE);
+			continue;
+		}
+		now = ktime_get_ns();
+		if (req->trigger > now + TICK_NSEC) {
+			list_add_tail(&item->link, &later);
+			if (next == 0 || req->trigger < next)
+				next = req->trigger;
+			continue;
+		}
+		if (req->trigger > now)
+			usleep_range((req->trigger - now) / NSEC_PER_USEC,
+			    (req->trigger - now) / NSEC_PER_USEC + 20);
+		switch (READ_ONCE(sc->state)) {
+		case AMZN_SFP_STATE_ABSENT:
+			error = -ENXIO;
+			break;
+		case AMZN_SFP_STATE_NOT_READY:
+		case AMZN_SFP_STATE_IDENTIFYING:
+			error = -EAGAIN;
+			break;
+		default:
+			error = 0;
+			break;
+		}
+		if (error) {
+			amzn_sfp_gather_complete(item, error);
+			continue;
+		}
+
+		trace_amzn_sfp_request(sc->port_id, AMZN_SFP_OP_GATHER,
+		    req->offset, req->length);
+		rt_mutex_lock(&sc->lock);
+		sc->owner = &req->owner;
+		if (req->trigger) {
+			item->res->timestamp = ktime_get_ns();
+			error = amzn_sfp_read_locked(sc, item->res->data,
+			    req->offset, req->length);
+		} else
+			error = amzn_sfp_read_cached(sc, item->res->data,
+			    req->offset, req->length);
+		sc->owner = NULL;
+		rt_mutex_unlock(&sc->lock);
+		trace_amzn_sfp_request_done(sc->port_id, AMZN_SFP_OP_GATHER,
+		    req->offset, error ? error : req->length);
+		if (!error)
+			item->res->length = req->length;
+		amzn_sfp_gather_complete(item, error);
+	}
+
+	if (!list_empty(&later)) {
+		spin_lock_bh(&sc->bus->lock);
+		list_splice(&later, &sc->gather_items);
+		spin_unlock_bh(&sc->bus->lock);
+		now = ktime_get_ns();
+		amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_GATHER,
+		    next > now ? nsecs_to_jiffies(next - now) : 0);
+	}
+}
+
+/*
+ * Queue an event for a client.  Events that don't fit are dropped and
+ * the next event that does is flagged.
+ */
+static void amzn_sfp_client_post(struct amzn_sfp_client *cl,
+    struct amzn_sfp_event *ev, const void *data)
+{
+	static const u8 pad[8];
+	size_t size = AMZN_SFP_EVENT_SIZE(ev->length);
+
+	spin_lock_bh(&cl->ev_lock);
+	if (kfifo_avail(&cl->events) < size) {
+		cl->ev_lost = true;
+		spin_unlock_bh(&cl->ev_lock);
+		return;
+	}
+	if (cl->ev_lost) {
+		ev->flags |= AMZN_SFP_EVENT_LOST;
+		cl->ev_lost = false;
+	}
+	kfifo_in(&cl->events, ev, sizeof(*ev));
+	kfifo_in(&cl->events, data, ev->length);
+	kfifo_in(&cl->events, pad, size - sizeof(*ev) - ev->length);
+	spin_unlock_bh(&cl->ev_lock);
+	wake_up_interruptible(&cl->ev_wq);
+}
+
+/*
+ * Queue an event for all clients of the port.  Called with the softc
+ * lock held.
+ */
+static void amzn_sfp_post_all(struct amzn_sfp_softc *sc,
+    const struct amzn_sfp_event *ev, const void *data)
+{
+	struct amzn_sfp_client *cl;
+	struct amzn_sfp_event tmp;
+
+	list_for_each_entry(cl, &sc->clients, link) {
+		tmp = *ev;
+		amzn_sfp_client_post(cl, &tmp, data);
+	}
+}
+
+static int amzn_sfp_cmp_u32(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+/*
+ * Whether two adjacent entries of the poll plan can be read in one go.
+ * Reading the gap between them must not clear latched flags.
+ */
+static bool amzn_sfp_poll_joinable(struct amzn_sfp_softc *sc, u32 start,
+    u32 end)
+{
+	loff_t rend;
+
+	if (start == end)
+		return true;
+	if (end - start > AMZN_SFP_POLL_GAP ||
+	    start / AMZN_SFP_HALF_SIZE != end / AMZN_SFP_HALF_SIZE)
+		return false;
+	return amzn_sfp_range_kind(sc, start, &rend) !=
+	    AMZN_SFP_RANGE_NOCACHE && rend >= end;
+}
+
+/* Whether [start, end) only holds per-lane monitors of inactive lanes. */
+static bool amzn_sfp_lanes_idle(struct amzn_sfp_softc *sc, u32 start,
+    u32 end)
+{
+	const struct amzn_sfp_backend *be = sc->backend;
+	const struct amzn_sfp_lane_mon *m;
+	unsigned int i, lane;
+
+	if (be == NULL || sc->lanes_off == 0)
+		return false;
+	for (i = 0; i < be->nlane_mons; i++) {
+		m = &be->lane_mons[i];
+		if (start < m->start || end > m->start + be->nlanes * m->size)
+			continue;
+		for (lane = (start - m->start) / m->size;
+		    m->start + lane * m->size < end; lane++) {
+			if (!(sc->lanes_off & BIT(lane)))
+				return false;
+		}
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Merge the interests and thresholds of all clients into the poll plan
+ * of the port.  The regions are split at every boundary, including
+ * those of per-lane monitors, and each piece is polled at the fastest
+ * interval of the regions that cover it, unless it only holds monitors
+ * of inactive lanes, and charged to the client that asked for it.  Then
+ * adjacent pieces with the same interval and owner are joined.  Called
+ * with the softc lock held.
+ */
+static int amzn_sfp_plan_build(struct amzn_sfp_softc *sc)
+{
+	const struct amzn_sfp_backend *be = sc->backend;
+	const struct amzn_sfp_owner **owners, *owner;
+	const struct amzn_sfp_lane_mon *m;
+	struct amzn_sfp_threshold *th;
+	struct amzn_sfp_interest *want, *in;
+	struct amzn_sfp_client *cl;
+	struct amzn_sfp_poll *plan, *p;
+	unsigned int i, k, n, nb, nl, np;
+	u32 *bounds, start, end, ival;
+
+	n = 0;
+	list_for_each_entry(cl, &sc->clients, link)
+		n += cl->ninterests + cl->nthresholds;
+	if (n == 0) {
+		kfree(sc->plan);
+		sc->plan = NULL;
+		sc->nplan = 0;
+		return 0;
+	}
+
+	if (sc->poll_data == NULL) {
+		sc->poll_data = kvzalloc(sc->attr.size, GFP_KERNEL);
+		if (sc->poll_data == NULL)
+			return -ENOMEM;
+	}
+	nl = (be != NULL && sc->lanes_off) ?
+	    be->nlane_mons * (be->nlanes + 1) : 0;
+	want = kmalloc_array(n, sizeof(*want), GFP_KERNEL);
+	owners = kmalloc_array(n, sizeof(*owners), GFP_KERNEL);
+	bounds = kmalloc_array(2 * n + nl, sizeof(*bounds), GFP_KERNEL);
+	plan = kmalloc_array(2 * n + nl, sizeof(*plan), GFP_KERNEL);
+	if (want == NULL || owners == NULL || bounds == NULL || plan == NULL) {
+		kfree(want);
+		kfree(owners);
+		kfree(bounds);
+		kfree(plan);
+		return -ENOMEM;
+	}
+
+	n = 0;
+	list_for_each_entry(cl, &sc->clients, link) {
+		for (k = 0; k < cl->ninterests; k++) {
+			owners[n] = &cl->owner;
+			want[n++] = cl->interests[k];
+		}
+		for (k = 0; k < cl->nthresholds; k++) {
+			th = &cl->thresholds[k];
+			owners[n] = &cl->owner;
+			in = &want[n++];
+			memset(in, 0, sizeof(*in));
+			in->region.offset = th->offset;
+			in->region.length = th->size;
+			in->interval_ms = th->interval_ms;
+		}
+	}
+
+	nb = 0;
+	for (k = 0; k < n; k++) {
+		bounds[nb++] = want[k].region.offset;
+		bounds[nb++] = want[k].region.offset + want[k].region.length;
+	}
+	for (i = 0; nl > 0 && i < be->nlane_mons; i++) {
+		m = &be->lane_mons[i];
+		for (k = 0; k <= be->nlanes; k++)
+			bounds[nb++] = m->start + k * m->size;
+	}
+	sort(bounds, nb, sizeof(*bounds), amzn_sfp_cmp_u32, NULL);
+
+	np = 0;
+	for (i = 0; i + 1 < nb; i++) {
+		start = bounds[i];
+		end = bounds[i + 1];
+		if (start == end)
+			continue;
+		ival = 0;
+		owner = NULL;
+		for (k = 0; k < n; k++) {
+			in = &want[k];
+			if (in->region.offset > start ||
+			    in->region.offset + in->region.length < end)
+				continue;
+			if (ival == 0 || in->interval_ms < ival) {
+				ival = in->interval_ms;
+				owner = owners[k];
+			}
+		}
+		if (ival == 0 || amzn_sfp_lanes_idle(sc, start, end))
+			continue;
+
+		p = (np > 0) ? &plan[np - 1] : NULL;
+		if (p != NULL && p->interval_ms == ival &&
+		    p->owner.tgid == owner->tgid &&
+		    p->owner.cgroup == owner->cgroup &&
+		    amzn_sfp_poll_joinable(sc, p->offset + p->length, start)) {
+			p->length = end - p->offset;
+			continue;
+		}
+		p = &plan[np++];
+		p->offset = start;
+		p->length = end - start;
+		p->interval_ms = ival;
+		p->due = jiffies;
+		p->status = 0;
+		p->owner = *owner;
+	}
+	kfree(bounds);
+	kfree(owners);
+	kfree(want);
+
+	kfree(sc->plan);
+	sc->plan = plan;
+	sc->nplan = np;
+	return 0;
+}
+
+/* The status of the last poll of a region.  Called with the lock held. */
+static int amzn_sfp_plan_status(struct amzn_sfp_softc *sc, u32 offset,
+    u32 length)
+{
+	struct amzn_sfp_poll *p;
+	unsigned int i;
+
+	for (i = 0; i < sc->nplan; i++) {
+		p = &sc->plan[i];
+		if (p->offset < offset + length &&
+		    p->offset + p->length > offset && p->status)
+			return p->status;
+	}
+	return 0;
+}
+
+/*
+ * Evaluate a threshold against freshly polled data and post an event
+ * when it's raised or cleared.  Called with the softc lock held.
+ */
+static void amzn_sfp_threshold_check(struct amzn_sfp_client *cl,
+    unsigned int k)
+{
+	struct amzn_sfp_threshold *th = &cl->thresholds[k];
+	struct amzn_sfp_softc *sc = cl->sc;
+	struct amzn_sfp_crossing cr;
+	struct amzn_sfp_event ev;
+	struct sk_buff *skb;
+	const u8 *data = sc->poll_data + th->offset;
+	void *hdr;
+	bool raised, low;
+	s32 v;
+
+	if (th->size == 1)
+		v = (th->flags & AMZN_SFP_THRESH_SIGNED) ? (s8)data[0] :
+		    data[0];
+	else
+		v = (th->flags & AMZN_SFP_THRESH_SIGNED) ?
+		    (s16)get_unaligned_be16(data) : get_unaligned_be16(data);
+
+	low = th->flags & AMZN_SFP_THRESH_LOW;
+	raised = test_bit(k, &cl->th_raised);
+	if (!raised && (low ? v <= th->set : v >= th->set))
+		__set_bit(k, &cl->th_raised);
+	else if (raised && (low ? v >= th->clear : v <= th->clear))
+		__clear_bit(k, &cl->th_raised);
+	else
+		return;
+
+	memset(&cr, 0, sizeof(cr));
+	cr.id = th->id;
+	cr.raised = !raised;
+	cr.value = v;
+	memset(&ev, 0, sizeof(ev));
+	ev.type = AMZN_SFP_EVENT_THRESHOLD;
+	ev.offset = th->offset;
+	ev.length = sizeof(cr);
+	ev.timestamp = ktime_get_ns();
+	amzn_sfp_client_post(cl, &ev, &cr);
+
+	skb = amzn_sfp_genl_start(sc, AMZN_SFP_CMD_THRESHOLD, &hdr);
+	if (skb == NULL)
+		return;
+	if (nla_put_u32(skb, AMZN_SFP_ATTR_OFFSET, th->offset) ||
+	    nla_put(skb, AMZN_SFP_ATTR_CROSSING, sizeof(cr), &cr)) {
+		nlmsg_free(skb);
+		return;
+	}
+	amzn_sfp_genl_send(skb, hdr, AMZN_SFP_CMD_THRESHOLD);
+}
+
+/*
+ * Follow the data path state of the lanes of a CMIS module, and rebuild
+ * the poll plan when lanes were (de)activated.  Called with the softc
+ * lock held.
+ */
+static void amzn_sfp_lanes_refresh(struct amzn_sfp_softc *sc)
+{
+	u8 st[4], off = 0;
+	unsigned int lane;
+
+	sc->lanes_due = jiffies + msecs_to_jiffies(AMZN_SFP_LANES_REFRESH_MS);
+	if (sc->flat_mem ||
+	    amzn_sfp_read_locked(sc, st, AMZN_CMIS_DP_STATE, sizeof(st)))
+		return;
+	for (lane = 0; lane < 8; lane++) {
+		if (((st[lane / 2] >> (4 * (lane % 2))) & 0x0f) ==
+		    AMZN_CMIS_DP_DEACTIVATED)
+			off |= BIT(lane);
+	}
+	if (off != sc->lanes_off) {
+		sc->lanes_off = off;
+		amzn_sfp_plan_build(sc);
+	}
+}
+
+/*
+ * Execute the poll plan of the port: read what's due and hand clients
+ * the data of their interests that are due.  Every interest is covered
+ * by plan entries that are polled at least as often as it, so the data
+ * is never older than the interval the client asked for.
+ */
+static void amzn_sfp_task_poll(struct amzn_sfp_softc *sc)
+{
+	struct amzn_sfp_threshold *th;
+	struct amzn_sfp_interest *in;
+	struct amzn_sfp_client *cl;
+	struct amzn_sfp_event ev;
+	struct amzn_sfp_poll *p;
+	unsigned long now, next;
+	unsigned int i, k;
+	int error, status;
+
+	rt_mutex_lock(&sc->lock);
+	if (sc->nplan == 0 || sc->gone) {
+		rt_mutex_unlock(&sc->lock);
+		return;
+	}
+
+	now = jiffies;
+	next = now + 60 * HZ;
+	switch (sc->state) {
+	case AMZN_SFP_STATE_READY:
+	case AMZN_SFP_STATE_UNKNOWN:
+		error = 0;
+		break;
+	case AMZN_SFP_STATE_ABSENT:
+		error = -ENXIO;
+		break;
+	default:
+		error = -EAGAIN;
+		break;
+	}
+	if (sc->lanes_auto && !error && time_after_eq(now, sc->lanes_due))
+		amzn_sfp_lanes_refresh(sc);
+	for (i = 0; i < sc->nplan; i++) {
+		p = &sc->plan[i];
+		if (time_before_eq(p->due, now)) {
+			if (!error && p->interval_ms >= AMZN_SFP_SLOW_POLL_MS &&
+			    amzn_sfp_bus_shed(sc->bus, true))
+				p->status = -EBUSY;
+			else if (error)
+				p->status = error;
+			else {
+				sc->owner = &p->owner;
+				p->status = amzn_sfp_read_locked(sc,
+				    sc->poll_data + p->offset, p->offset,
+				    p->length);
+				sc->owner = NULL;
+			}
+			p->due += msecs_to_jiffies(p->interval_ms);
+			if (time_before_eq(p->due, now))
+				p->due = now + msecs_to_jiffies(p->interval_ms);
+		}
+		if (time_before(p->due, next))
+			next = p->due;
+	}
+
+	list_for_each_entry(cl, &sc->clients, link) {
+		for (k = 0; k < cl->nthresholds; k++) {
+			th = &cl->thresholds[k];
+			if (time_after(cl->th_due[k], now)) {
+				if (time_before(cl->th_due[k], next))
+					next = cl->th_due[k];
+				continue;
+			}
+			cl->th_due[k] = now + msecs_to_jiffies(th->interval_ms);
+			if (time_before(cl->th_due[k], next))
+				next = cl->th_due[k];
+			if (amzn_sfp_lanes_idle(sc, th->offset,
+			    th->offset + th->size))
+				continue;
+			if (amzn_sfp_plan_status(sc, th->offset, th->size) == 0)
+				amzn_sfp_threshold_check(cl, k);
+		}
+		for (k = 0; k < cl->ninterests; k++) {
+			in = &cl->interests[k];
+			if (time_after(cl->due[k], now)) {
+				if (time_before(cl->due[k], next))
+					next = cl->due[k];
+				continue;
+			}
+			cl->due[k] = now + msecs_to_jiffies(in->interval_ms);
+			if (time_before(cl->due[k], next))
+				next = cl->due[k];
+
+			status = amzn_sfp_plan_status(sc, in->region.offset,
+			    in->region.length);
+			memset(&ev, 0, sizeof(ev));
+			ev.type = AMZN_SFP_EVENT_DATA;
+			ev.offset = in->region.offset;
+			ev.status = status;
+			ev.length = status ? 0 : in->region.length;
+			ev.timestamp = ktime_get_ns();
+			amzn_sfp_client_post(cl, &ev,
+			    sc->poll_data + in->region.offset);
+		}
+	}
+	rt_mutex_unlock(&sc->lock);
+
+	amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_POLL,
+	    time_after(next, now) ? next - now : 0);
+}
+
+/*
+ * Access registers on a page of A2h of an SFP+ module, other than page
+ * 00h.  Page 00h is selected again afterwards, because that's what the
+ * eeprom file shows.  Called with the softc lock held.
+ */
+static int amzn_sfp_a2_rw(struct amzn_sfp_softc *sc, u8 page, u8 reg,
+    u8 *buf, size_t len, u16 flags)
+{
+	ssize_t result;
+	int error;
+	u8 sel;
+
+	sel = page;
+	result = amzn_sfp_rw_locked(sc, &sel,
+	    AMZN_SFF8472_A2 + AMZN_SFF8472_PAGE_SELECT, 1, 0);
+	if (result < 0)
+		return result;
+	result = amzn_sfp_rw_locked(sc, buf, AMZN_SFF8472_A2 + reg, len,
+	    flags);
+	sel = 0;
+	error = amzn_sfp_rw_locked(sc, &sel,
+	    AMZN_SFF8472_A2 + AMZN_SFF8472_PAGE_SELECT, 1, 0);
+	if (result < 0)
+		return result;
+	if (result != len)
+		return -EIO;
+	return (error < 0) ? error : 0;
+}
+
+/* Called with the softc lock held. */
+static void amzn_sfp_tune_done(struct amzn_sfp_softc *sc, int status)
+{
+	struct amzn_sfp_event ev;
+
+	sc->tune_active = false;
+	memset(&ev, 0, sizeof(ev));
+	ev.type = AMZN_SFP_EVENT_TUNED;
+	ev.status = status;
+	ev.timestamp = ktime_get_ns();
+	amzn_sfp_post_all(sc, &ev, NULL);
+}
+
+/*
+ * Poll a tuning module for completion, with a back-off, so that the
+ * retune time is bounded by the laser and not by our polling.  The
+ * latched bits are cleared on read, so they are accumulated.
+ */
+static void amzn_sfp_task_tune(struct amzn_sfp_softc *sc)
+{
+	u8 status[AMZN_SFF8690_LATCHED - AMZN_SFF8690_STATUS + 1];
+	unsigned int delay;
+	int error;
+
+	rt_mutex_lock(&sc->lock);
+	if (!sc->tune_active || sc->gone) {
+		rt_mutex_unlock(&sc->lock);
+		return;
+	}
+	if (sc->state != AMZN_SFP_STATE_READY &&
+	    sc->state != AMZN_SFP_STATE_UNKNOWN) {
+		amzn_sfp_tune_done(sc, -ENXIO);
+		rt_mutex_unlock(&sc->lock);
+		return;
+	}
+
+	error = amzn_sfp_a2_rw(sc, AMZN_SFF8690_PAGE, AMZN_SFF8690_STATUS,
+	    status, sizeof(status), I2C_M_RD);
+	if (error) {
+		amzn_sfp_tune_done(sc, error);
+		rt_mutex_unlock(&sc->lock);
+		return;
+	}
+	sc->tune_latched |= status[AMZN_SFF8690_LATCHED - AMZN_SFF8690_STATUS];
+	if (sc->tune_latched & AMZN_SFF8690_L_BAD_CHANNEL) {
+		amzn_sfp_tune_done(sc, -EINVAL);
+		rt_mutex_unlock(&sc->lock);
+		return;
+	}
+	if (!(status[0] & AMZN_SFF8690_TX_TUNE) &&
+	    (sc->tune_latched & AMZN_SFF8690_L_NEW_CHANNEL)) {
+		amzn_sfp_tune_done(sc, 0);
+		rt_mutex_unlock(&sc->lock);
+		return;
+	}
+	if (time_after(jiffies, sc->tune_deadline)) {
+		amzn_sfp_tune_done(sc, -ETIMEDOUT);
+		rt_mutex_unlock(&sc->lock);
+		return;
+	}
+
+	delay = sc->tune_poll_ms;
+	sc->tune_poll_ms = min(2 * delay, AMZN_SFP_TUNE_POLL_MAX);
+	rt_mutex_unlock(&sc->lock);
+	amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_TUNE, msecs_to_jiffies(delay));
+}
+
+/* Allocate the history of the port.  Called with the softc lock held. */
+static int amzn_sfp_history_alloc(struct amzn_sfp_softc *sc)
+{
+	const struct amzn_sfp_backend *be = sc->backend;
+	size_t len = 0;
+	unsigned int i;
+
+	if (sc->history != NULL)
+		return 0;
+	if (be == NULL || be->ndiag == 0)
+		return -EOPNOTSUPP;
+	for (i = 0; i < be->ndiag; i++)
+		len += be->diag[i].end - be->diag[i].start;
+	sc->hist_stride = AMZN_SFP_SAMPLE_STRIDE(len);
+	sc->history = kvzalloc(AMZN_SFP_HISTORY_LEN * sc->hist_stride,
+	    GFP_KERNEL);
+	return (sc->history != NULL) ? 0 : -ENOMEM;
+}
+
+/*
+ * Whether a range of latched flags may have anything latched, according
+ * to its summary.  Returns 1 when it may, or when there's no usable
+ * summary, 0 when it doesn't, or a negative errno.  Called with the
+ * softc lock held.
+ */
+static int amzn_sfp_flags_pending(struct amzn_sfp_softc *sc,
+    const struct amzn_sfp_range *r)
+{
+	const struct amzn_sfp_backend *be = sc->backend;
+	const struct amzn_sfp_summary *sum;
+	ssize_t result;
+	unsigned int i;
+	u8 val;
+
+	for (i = 0; i < be->nsummaries; i++) {
+		sum = &be->summaries[i];
+		if (sum->start != r->start)
+			continue;
+		if ((sum->intl && sc->masks_set) ||
+		    sc->cmis_rev < sum->cmis_rev)
+			return 1;
+		result = amzn_sfp_rw_locked(sc, &val, sum->reg, 1, I2C_M_RD);
+		if (result < 0)
+			return result;
+		if (sum->active_low)
+			return (val & sum->bits) != sum->bits;
+		return (val & sum->bits) != 0;
+	}
+	return 1;
+}
+
+/*
+ * Sample the diagnostics of the module into the history.  Latched flags
+ * are only read when asked for, because reading clears them.  Paged
+ * ranges of flat memory modules don't exist and are left zero.  Called
+ * with the softc lock held.
+ */
+static int amzn_sfp_sample(struct amzn_sfp_softc *sc, u32 flags)
+{
+	const struct amzn_sfp_backend *be = sc->backend;
+	const struct amzn_sfp_range *r;
+	struct amzn_sfp_sample *smp;
+	unsigned int i;
+	u8 *data;
+	int error;
+
+	error = amzn_sfp_history_alloc(sc);
+	if (error)
+		return error;
+
+	smp = (void *)(sc->history + sc->hist_head * sc->hist_stride);
+	memset(smp, 0, sc->hist_stride);
+	data = smp->data;
+	for (i = 0; i < be->ndiag; i++) {
+		r = &be->diag[i];
+		if ((r->kind != AMZN_SFP_RANGE_NOCACHE ||
+		    (flags & AMZN_SFP_SAMPLE_LATCHED)) &&
+		    (!sc->flat_mem || r->end <= AMZN_SFP_PAGE(0x01))) {
+			/* Latched flags are read only when there are any. */
+			error = (r->kind == AMZN_SFP_RANGE_NOCACHE) ?
+			    amzn_sfp_flags_pending(sc, r) : 1;
+			if (error > 0)
+				error = amzn_sfp_read_locked(sc, data,
+				    r->start, r->end - r->start);
+			if (error)
+				return error;
+		}
+		data += r->end - r->start;
+	}
+	smp->timestamp = ktime_get_ns();
+	smp->flags = flags;
+	smp->length = data - smp->data;
+
+	sc->hist_head = (sc->hist_head + 1) % AMZN_SFP_HISTORY_LEN;
+	if (sc->hist_count < AMZN_SFP_HISTORY_LEN)
+		sc->hist_count++;
+	return 0;
+}
+
+/* Sample into the rolling history, unless the bus is overloaded. */
+static void amzn_sfp_task_history(struct amzn_sfp_softc *sc)
+{
+	int ms = READ_ONCE(amzn_sfp_history_ms);
+
+	if (ms <= 0)
+		return;
+	if (!amzn_sfp_bus_shed(sc->bus, true)) {
+		rt_mutex_lock(&sc->lock);
+		if (sc->state == AMZN_SFP_STATE_READY)
+			amzn_sfp_sample(sc, 0);
+		rt_mutex_unlock(&sc->lock);
+	}
+	amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_HISTORY,
+	    msecs_to_jiffies(ms));
+}
+
+/* Take the next sample of a burst; bursts go ahead of everything else. */
+static void amzn_sfp_task_burst(struct amzn_sfp_softc *sc)
+{
+	struct amzn_sfp_event ev;
+	int error;
+
+	rt_mutex_lock(&sc->lock);
+	if (sc->burst_left == 0) {
+		rt_mutex_unlock(&sc->lock);
+		return;
+	}
+	if (sc->state == AMZN_SFP_STATE_READY ||
+	    sc->state == AMZN_SFP_STATE_UNKNOWN)
+		error = amzn_sfp_sample(sc, sc->burst_flags);
+	else
+		error = -ENXIO;
+	if (!error && --sc->burst_left > 0) {
+		rt_mutex_unlock(&sc->lock);
+		amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_BURST,
+		    msecs_to_jiffies(sc->burst_interval_ms));
+		return;
+	}
+
+	sc->burst_left = 0;
+	memset(&ev, 0, sizeof(ev));
+	ev.type = AMZN_SFP_EVENT_BURST;
+	ev.status = error;
+	ev.timestamp = ktime_get_ns();
+	amzn_sfp_post_all(sc, &ev, NULL);
+	rt_mutex_unlock(&sc->lock);
+}
+
+/*
+ * Freeze or unfreeze the VDM and PM of a CMIS module.  Freezing waits
+ * for the module to confirm.  Called with the softc lock held.
+ */
+static int amzn_sfp_vdm_freeze(struct amzn_sfp_softc *sc, bool freeze)
+{
+	u8 val = freeze ? AMZN_CMIS_VDM_FREEZE_REQ : 0;
+	ssize_t result;
+	int tries;
+
+	result = amzn_sfp_rw_locked(sc, &val, AMZN_SFP_PAGE_OFFSET(
+	    AMZN_CMIS_VDM_PAGE, AMZN_CMIS_VDM_FREEZE), 1, 0);
+	if (result < 0 || !freeze)
+		return (result < 0) ? result : 0;
+
+	for (tries = 0; tries < AMZN_CMIS_FREEZE_TRIES; tries++) {
+		usleep_range(1000, 1500);
+		result = amzn_sfp_rw_locked(sc, &val, AMZN_SFP_PAGE_OFFSET(
+		    AMZN_CMIS_VDM_PAGE, AMZN_CMIS_VDM_FREEZE_DONE), 1,
+		    I2C_M_RD);
+		if (result < 0)
+			return result;
+		if (val & AMZN_CMIS_VDM_FROZEN)
+			return 0;
+	}
+	return -ETIMEDOUT;
+}
+
+/*
+ * Whether the module is a coherent one with VDM: 1 if it is, 0 if it
+ * isn't or a negative errno when that couldn't be read.  What it takes
+ * to tell is static and cached.  Called with the softc lock held.
+ */
+static int amzn_sfp_pm_coherent(struct amzn_sfp_softc *sc)
+{
+	u8 pages, media, mif;
+	int error;
+
+	error = amzn_sfp_read_cached(sc, &pages, AMZN_CMIS_PAGES_SUPPORTED, 1);
+	if (!error)
+		error = amzn_sfp_read_cached(sc, &media, AMZN_CMIS_MEDIA_TYPE,
+		    1);
+	if (!error)
+		error = amzn_sfp_read_cached(sc, &mif, AMZN_CMIS_MEDIA_IF, 1);
+	if (error)
+		return error;
+	if (!(pages & AMZN_CMIS_VDM_SUPPORTED) || media != AMZN_CMIS_MEDIA_SMF)
+		return 0;
+	switch (mif) {
+	case 0x3e:	/* 400ZR, DWDM, amplified */
+	case 0x3f:	/* 400ZR, single wavelength, unamplified */
+	case 0x46:	/* ZR400-OFEC-16QAM */
+	case 0x47:	/* ZR300-OFEC-8QAM */
+	case 0x48:	/* ZR200-OFEC-QPSK */
+	case 0x49:	/* ZR100-OFEC-QPSK */
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Collect the PM pages of a coherent module in one locked batch: freeze,
+ * read the pages in order, unfreeze.  The snapshot is published to the
+ * clients of the port.  Modules that aren't coherent aren't touched
+ * until they're replaced.  Failures are published too, and collection
+ * backs off, doubling the interval with every failure in a row.
+ */
+static void amzn_sfp_task_pm(struct amzn_sfp_softc *sc)
+{
+	struct amzn_sfp_event ev;
+	unsigned long delay;
+	int error;
+
+	rt_mutex_lock(&sc->lock);
+	if (!amzn_sfp_pm_enabled(sc) || sc->state != AMZN_SFP_STATE_READY) {
+		rt_mutex_unlock(&sc->lock);
+		return;
+	}
+	error = amzn_sfp_pm_coherent(sc);
+	if (error == 0) {
+		sc->pm_unsupported = true;
+		rt_mutex_unlock(&sc->lock);
+		return;
+	}
+	if (error > 0 && sc->pm == NULL) {
+		sc->pm = kzalloc(AMZN_CMIS_PM_SIZE, GFP_KERNEL);
+		if (sc->pm == NULL)
+			error = -ENOMEM;
+	}
+
+	if (error > 0) {
+		error = amzn_sfp_vdm_freeze(sc, true);
+		if (!error)
+			error = amzn_sfp_read_locked(sc, sc->pm,
+			    AMZN_SFP_PAGE(AMZN_CMIS_PM_FIRST),
+			    AMZN_CMIS_PM_SIZE);
+		amzn_sfp_vdm_freeze(sc, false);
+	}
+	if (!error)
+		sc->pm_failures = 0;
+	else if (sc->pm_failures++ == 0)
+		dev_info(&sc->client->dev,
+		    "unable to collect PM (error %d); backing off\n", error);
+	delay = msecs_to_jiffies(amzn_sfp_pm_ms) <<
+	    min(sc->pm_failures, AMZN_SFP_PM_BACKOFF_MAX);
+	sc->pm_ts = ktime_get_ns();
+	sc->pm_status = error;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = AMZN_SFP_EVENT_PM;
+	ev.offset = AMZN_SFP_PAGE(AMZN_CMIS_PM_FIRST);
+	ev.status = error;
+	ev.length = error ? 0 : AMZN_CMIS_PM_SIZE;
+	ev.timestamp = sc->pm_ts;
+	amzn_sfp_post_all(sc, &ev, sc->pm);
+	rt_mutex_unlock(&sc->lock);
+
+	if (amzn_sfp_pm_enabled(sc))
+		amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_PM, delay);
+}
+
+/*
+ * Access registers on an upper page of a CMIS module.  Writes invalidate
+ * what's cached of them.  Called with the softc lock held.
+ */
+static int amzn_sfp_page_rw(struct amzn_sfp_softc *sc, u8 page, u8 reg,
+    u8 *buf, size_t len, u16 flags)
+{
+	loff_t ofs = AMZN_SFP_PAGE_OFFSET(page, reg);
+	ssize_t result;
+
+	result = amzn_sfp_rw_locked(sc, buf, ofs, len, flags);
+	if (result < 0)
+		return result;
+	if (result != len)
+		return -EIO;
+	if (!(flags & I2C_M_RD))
+		amzn_sfp_cache_invalidate(sc, ofs, len);
+	return 0;
+}
+
+/*
+ * Set the generators, checkers and loopbacks of a diagnostic session,
+ * or turn them all off with flags 0.  Loopbacks are closed before the
+ * generators and checkers start and opened after they stop, so that the
+ * checkers don't count errors that the session didn't cause.  Called
+ * with the softc lock held.
+ */
+static int amzn_sfp_diag_controls(struct amzn_sfp_softc *sc, u32 flags,
+    u8 lanes, u8 pattern)
+{
+	static const struct {
+		u32	flag;
+		u8	enable;
+		u8	pattern;
+	} ctl[] = {
+		{ AMZN_SFP_DIAG_GEN_HOST,
+		  AMZN_CMIS_HOST_GEN_EN, AMZN_CMIS_HOST_GEN_PAT },
+		{ AMZN_SFP_DIAG_GEN_MEDIA,
+		  AMZN_CMIS_MEDIA_GEN_EN, AMZN_CMIS_MEDIA_GEN_PAT },
+		{ AMZN_SFP_DIAG_CHK_HOST,
+		  AMZN_CMIS_HOST_CHK_EN, AMZN_CMIS_HOST_CHK_PAT },
+		{ AMZN_SFP_DIAG_CHK_MEDIA,
+		  AMZN_CMIS_MEDIA_CHK_EN, AMZN_CMIS_MEDIA_CHK_PAT },
+	};
+	static const u32 lb_flags[4] = {
+		AMZN_SFP_DIAG_LB_MEDIA_OUT, AMZN_SFP_DIAG_LB_MEDIA_IN,
+		AMZN_SFP_DIAG_LB_HOST_OUT, AMZN_SFP_DIAG_LB_HOST_IN,
+	};
+	u8 pat[AMZN_SFP_DIAG_LANES / 2] = { 0 };
+	u8 lb[ARRAY_SIZE(lb_flags)];
+	unsigned int i;
+	int error;
+	u8 en;
+
+	for (i = 0; i < AMZN_SFP_DIAG_LANES; i++)
+		if (lanes & BIT(i))
+			pat[i / 2] |= (pattern & 0xf) << (4 * (i % 2));
+	for (i = 0; i < ARRAY_SIZE(lb_flags); i++)
+		lb[i] = (flags & lb_flags[i]) ? lanes : 0;
+
+	if (flags != 0) {
+		error = amzn_sfp_page_rw(sc, AMZN_CMIS_DIAG_PAGE,
+		    AMZN_CMIS_LOOPBACK, lb, sizeof(lb), 0);
+		if (error)
+			return error;
+	}
+	for (i = 0; i < ARRAY_SIZE(ctl); i++) {
+		en = (flags & ctl[i].flag) ? lanes : 0;
+		if (en) {
+			error = amzn_sfp_page_rw(sc, AMZN_CMIS_DIAG_PAGE,
+			    ctl[i].pattern, pat, sizeof(pat), 0);
+			if (error)
+				return error;
+		}
+		error = amzn_sfp_page_rw(sc, AMZN_CMIS_DIAG_PAGE,
+		    ctl[i].enable, &en, 1, 0);
+		if (error)
+			return error;
+	}
+	if (flags == 0)
+		return amzn_sfp_page_rw(sc, AMZN_CMIS_DIAG_PAGE,
+		    AMZN_CMIS_LOOPBACK, lb, sizeof(lb), 0);
+	return 0;
+}
+
+/*
+ * Read the counters of the checkers of the session, four lanes at a
+ * time, and accumulate them.  A module resets its counters when a
+ * checker restarts; what was counted before then is kept in the base.
+ * Called with the softc lock held.
+ */
+static int amzn_sfp_diag_read(struct amzn_sfp_softc *sc)
+{
+	static const u32 chk[2] = {
+		[AMZN_SFP_DIAG_SIDE_HOST] = AMZN_SFP_DIAG_CHK_HOST,
+		[AMZN_SFP_DIAG_SIDE_MEDIA] = AMZN_SFP_DIAG_CHK_MEDIA,
+	};
+	static const u8 sel[2] = {
+		[AMZN_SFP_DIAG_SIDE_HOST] = AMZN_CMIS_DIAG_SEL_HOST,
+		[AMZN_SFP_DIAG_SIDE_MEDIA] = AMZN_CMIS_DIAG_SEL_MEDIA,
+	};
+	u8 data[AMZN_CMIS_DIAG_DATA_SIZE];
+	unsigned int side, group, lane, i;
+	u64 *last, *base, v;
+	int error;
+	u8 val;
+
+	for (side = 0; side < ARRAY_SIZE(chk); side++) {
+		if (!(sc->diag_flags & chk[side]))
+			continue;
+		for (group = 0; group < 2; group++) {
+			if (!(sc->diag_lanes & (0xf << (4 * group))))
+				continue;
+			val = sel[side] + group;
+			error = amzn_sfp_page_rw(sc, AMZN_CMIS_RESULT_PAGE,
+			    AMZN_CMIS_DIAG_SELECT, &val, 1, 0);
+			if (error)
+				return error;
+			usleep_range(AMZN_CMIS_DIAG_LATCH_US,
+			    2 * AMZN_CMIS_DIAG_LATCH_US);
+			error = amzn_sfp_page_rw(sc, AMZN_CMIS_RESULT_PAGE,
+			    AMZN_CMIS_DIAG_DATA, data, sizeof(data), I2C_M_RD);
+			if (error)
+				return error;
+
+			for (lane = 4 * group; lane < 4 * group + 4; lane++) {
+				if (!(sc->diag_lanes & BIT(lane)))
+					continue;
+				last = sc->diag_last[side][lane];
+				base = sc->diag_base[side][lane];
+				for (i = 0; i < 2; i++) {
+					v = get_unaligned_be64(data +
+					    16 * (lane % 4) + 8 * i);
+					if (v < last[i])
+						base[i] += last[i];
+					last[i] = v;
+				}
+			}
+		}
+	}
+	sc->diag_ts = ktime_get_ns();
+	return 0;
+}
+
+/*
+ * End the diagnostic session of the port and tell its clients.  The
+ * controls are left alone when the module is gone.  Called with the
+ * softc lock held.
+ */
+static void amzn_sfp_diag_end(struct amzn_sfp_softc *sc, int status)
+{
+	struct amzn_sfp_event ev;
+
+	if (status != -ENXIO)
+		amzn_sfp_diag_controls(sc, 0, 0, 0);
+	sc->diag_active = false;
+	sc->diag_client = NULL;
+	sc->diag_status = status;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = AMZN_SFP_EVENT_DIAG;
+	ev.status = status;
+	ev.timestamp = ktime_get_ns();
+	amzn_sfp_post_all(sc, &ev, NULL);
+}
+
+/*
+ * Read the counters a last time and end the diagnostic session of the
+ * port, if any.  Called with the softc lock held.
+ */
+static int amzn_sfp_diag_stop(struct amzn_sfp_softc *sc)
+{
+	int error;
+
+	if (!sc->diag_active)
+		return 0;
+	if (sc->gone || sc->diag_status || sc->state != AMZN_SFP_STATE_READY)
+		error = -ENXIO;
+	else
+		error = amzn_sfp_diag_read(sc);
+	amzn_sfp_diag_end(sc, error);
+	return error;
+}
+
+/* Read the counters of a diagnostic session, every interval. */
+static void amzn_sfp_task_diag(struct amzn_sfp_softc *sc)
+{
+	unsigned long delay;
+	int error;
+
+	rt_mutex_lock(&sc->lock);
+	if (!sc->diag_active || sc->gone) {
+		rt_mutex_unlock(&sc->lock);
+		return;
+	}
+	if (sc->diag_status || sc->state != AMZN_SFP_STATE_READY) {
+		amzn_sfp_diag_end(sc, -ENXIO);
+		rt_mutex_unlock(&sc->lock);
+		return;
+	}
+
+	error = amzn_sfp_diag_read(sc);
+	if (error || (sc->diag_deadline &&
+	    time_after_eq(jiffies, sc->diag_deadline))) {
+		amzn_sfp_diag_end(sc, error);
+		rt_mutex_unlock(&sc->lock);
+		return;
+	}
+
+	delay = msecs_to_jiffies(sc->diag_interval_ms);
+	if (sc->diag_deadline)
+		delay = min(delay, sc->diag_deadline - jiffies);
+	rt_mutex_unlock(&sc->lock);
+	amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_DIAG, delay);
+}
+
+/* Whether a sample has any latched flag set. */
+static bool amzn_sfp_sample_latched(struct amzn_sfp_softc *sc,
+    const struct amzn_sfp_sample *smp)
+{
+	const struct amzn_sfp_backend *be = sc->backend;
+	const struct amzn_sfp_range *r;
+	const u8 *data = smp->data;
+	unsigned int i;
+
+	for (i = 0; i < be->ndiag; i++) {
+		r = &be->diag[i];
+		if (r->kind == AMZN_SFP_RANGE_NOCACHE &&
+		    memchr_inv(data, 0, r->end - r->start) != NULL)
+			return true;
+		data += r->end - r->start;
+	}
+	return false;
+}
+
+/* The IntL rate above which a port is considered to storm. */
+static int
+amzn_sfp_intl_storm_limit(void)
+{
+	int windows = 1000 / max(amzn_sfp_intl_window_ms, 1);
+
+	return min(amzn_sfp_intl_storm, max(windows / 2, 1));
+}
+
+/*
+ * IntL was asserted, by interrupt or as seen by a presence provider.
+ * Have the bus worker read the latched flags, which deasserts it, after
+ * the coalescing window.
+ */
+static void amzn_sfp_intl_assert(struct amzn_sfp_softc *sc)
+{
+	struct amzn_sfp_bus *bus = sc->bus;
+	unsigned long delay;
+
+	spin_lock_bh(&bus->lock);
+	sc->intl_irqs++;
+	if (time_after(jiffies, sc->intl_rate_start + HZ)) {
+		sc->intl_rate_start = jiffies;
+		sc->intl_rate = 0;
+	}
+	if (++sc->intl_rate > amzn_sfp_intl_storm_limit() &&
+	    amzn_sfp_intl_storm > 0 && !sc->intl_storm) {
+		sc->intl_storm = true;
+		sc->intl_storms++;
+		dev_warn_ratelimited(&sc->client->dev,
+		    "IntL storm; polling flags instead\n");
+	}
+	delay = msecs_to_jiffies(sc->intl_storm ? AMZN_SFP_INTL_STORM_POLL :
+	    amzn_sfp_intl_window_ms);
+	spin_unlock_bh(&bus->lock);
+
+	amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_INTL, delay);
+}
+
+/* Keep IntL disabled until it has been serviced. */
+static irqreturn_t amzn_sfp_intl_irq(int irq, void *arg)
+{
+	struct amzn_sfp_softc *sc = arg;
+
+	disable_irq_nosync(irq);
+	spin_lock_bh(&sc->bus->lock);
+	sc->intl_off = true;
+	spin_unlock_bh(&sc->bus->lock);
+	amzn_sfp_intl_assert(sc);
+	return IRQ_HANDLED;
+}
+
+/*
+ * Service IntL: take a sample with the latched flags and hand it to the
+ * clients of the port.  Ports beyond the budget of the bus for the
+ * current window wait for the next one, so that a noisy module can't
+ * starve the others.  A port in a storm stays polled until a sample
+ * has no latched flags.
+ */
+static void amzn_sfp_task_intl(struct amzn_sfp_softc *sc)
+{
+	struct amzn_sfp_bus *bus = sc->bus;
+	unsigned long window = msecs_to_jiffies(amzn_sfp_intl_window_ms);
+	struct amzn_sfp_sample *smp;
+	struct amzn_sfp_event ev;
+	bool enable, storm, quiet = false;
+
+	spin_lock_bh(&bus->lock);
+	if (time_after_eq(jiffies, bus->intl_win_start + window)) {
+		bus->intl_win_start = jiffies;
+		bus->intl_used = 0;
+	}
+	if (amzn_sfp_intl_budget > 0 &&
+	    bus->intl_used >= amzn_sfp_intl_budget) {
+		sc->intl_deferred++;
+		spin_unlock_bh(&bus->lock);
+		amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_INTL,
+		    bus->intl_win_start + window - jiffies);
+		return;
+	}
+	bus->intl_used++;
+	spin_unlock_bh(&bus->lock);
+
+	rt_mutex_lock(&sc->lock);
+	if (sc->gone) {
+		rt_mutex_unlock(&sc->lock);
+		return;
+	}
+	if (sc->state == AMZN_SFP_STATE_READY &&
+	    amzn_sfp_sample(sc, AMZN_SFP_SAMPLE_LATCHED) == 0) {
+		smp = (void *)(sc->history + ((sc->hist_head +
+		    AMZN_SFP_HISTORY_LEN - 1) % AMZN_SFP_HISTORY_LEN) *
+		    sc->hist_stride);
+		quiet = !amzn_sfp_sample_latched(sc, smp);
+		if (!quiet)
+			amzn_sfp_genl_alarm(sc, smp);
+
+		memset(&ev, 0, sizeof(ev));
+		ev.type = AMZN_SFP_EVENT_INTL;
+		ev.length = smp->length;
+		ev.timestamp = smp->timestamp;
+		amzn_sfp_post_all(sc, &ev, smp->data);
+	}
+
+	spin_lock_bh(&bus->lock);
+	sc->intl_serviced++;
+	if (sc->intl_storm && quiet) {
+		sc->intl_storm = false;
+		sc->intl_rate_start = jiffies;
+		sc->intl_rate = 0;
+	}
+	storm = sc->intl_storm;
+	enable = !storm && sc->intl_off && sc->irq > 0;
+	if (enable)
+		sc->intl_off = false;
+	spin_unlock_bh(&bus->lock);
+
+	/*
+	 * Remove clears sc->irq under the lock before freeing the
+	 * interrupt, so it's only enabled while it's still requested.
+	 */
+	if (enable)
+		enable_irq(sc->irq);
+	else if (storm)
+		amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_INTL,
+		    msecs_to_jiffies(AMZN_SFP_INTL_STORM_POLL));
+	rt_mutex_unlock(&sc->lock);
+}
+
+static void (* const amzn_sfp_tasks[AMZN_SFP_NTASKS])(struct amzn_sfp_softc *) = {
+	[AMZN_SFP_TASK_BURST] = amzn_sfp_task_burst,
+	[AMZN_SFP_TASK_READY] = amzn_sfp_task_state,
+	[AMZN_SFP_TASK_IDENTIFY] = amzn_sfp_task_identify,
+	[AMZN_SFP_TASK_TUNE] = amzn_sfp_task_tune,
+	[AMZN_SFP_TASK_INTL] = amzn_sfp_task_intl,
+	[AMZN_SFP_TASK_GATHER] = amzn_sfp_task_gather,
+	[AMZN_SFP_TASK_DIAG] = amzn_sfp_task_diag,
+	[AMZN_SFP_TASK_PM] = amzn_sfp_task_pm,
+	[AMZN_SFP_TASK_POLL] = amzn_sfp_task_poll,
+	[AMZN_SFP_TASK_HISTORY] = amzn_sfp_task_history,
+	[AMZN_SFP_TASK_PRESENCE] = amzn_sfp_task_state,
+};
+
+/*
+ * Find the port with the highest priority task that is due.  If there
+ * is none, arm the worker for the first task that will become due.
+ * Called with the bus lock held.
+ */
+static struct amzn_sfp_softc *amzn_sfp_bus_next(struct amzn_sfp_bus *bus,
+    int *taskp)
+{
+	struct amzn_sfp_softc *sc, *best = NULL;
+	unsigned long now = jiffies, next = 0;
+	int task, best_task = AMZN_SFP_NTASKS;
+	unsigned int depth = 0;
+	bool have_next = false;
+
+	list_for_each_entry(sc, &bus->ports, bus_link) {
+		for_each_set_bit(task, &sc->tasks, AMZN_SFP_NTASKS) {
+			if (time_after(sc->task_due[task], now)) {
+				if (!have_next ||
+				    time_before(sc->task_due[task], next))
+					next = sc->task_due[task];
+				have_next = true;
+				continue;
+			}
+			depth++;
+			if (task < best_task) {
+				best = sc;
+				best_task = task;
+			}
+		}
+	}
+
+	if (best == NULL && have_next)
+		amzn_sfp_bus_arm(bus, next);
+	bus->depth = depth;
+	bus->max_depth = max(bus->max_depth, depth);
+	*taskp = best_task;
+	return best;
+}
+
+static void amzn_sfp_bus_work(struct work_struct *work)
+{
+	struct amzn_sfp_bus *bus = container_of(to_delayed_work(work),
+	    struct amzn_sfp_bus, work);
+	struct amzn_sfp_softc *sc;
+	u64 wait;
+	int task;
+
+	for (;;) {
+		spin_lock_bh(&bus->lock);
+		sc = amzn_sfp_bus_next(bus, &task);
+		if (sc == NULL) {
+			spin_unlock_bh(&bus->lock);
+			return;
+		}
+		__clear_bit(task, &sc->tasks);
+		/* How long the task waited for the bus after it was due. */
+		wait = jiffies_to_nsecs(jiffies - sc->task_due[task]);
+		bus->waits++;
+		bus->wait_ns += wait;
+		bus->max_wait_ns = max(bus->max_wait_ns, wait);
+		/* Round-robin between ports with tasks of equal priority. */
+		list_move_tail(&sc->bus_link, &bus->ports);
+		spin_unlock_bh(&bus->lock);
+
+		amzn_sfp_tasks[task](sc);
+		cond_resched();
+	}
+}
+
+/* Attach the port to the bus of its root adapter, creating it if needed. */
+static int amzn_sfp_bus_attach(struct amzn_sfp_softc *sc)
+{
+	struct i2c_adapter *root;
+	struct amzn_sfp_bus *bus;
+
+	root = i2c_root_adapter(&sc->client->dev);
+	if (root == NULL)
+		root = sc->client->adapter;
+
+	mutex_lock(&amzn_sfp_buses_lock);
+	list_for_each_entry(bus, &amzn_sfp_buses, link) {
+		if (bus->adapter == root)
+			goto found;
+	}
+
+	bus = kzalloc(sizeof(*bus), GFP_KERNEL);
+	if (bus == NULL) {
+		mutex_unlock(&amzn_sfp_buses_lock);
+		return -ENOMEM;
+	}
+	bus->adapter = root;
+	INIT_LIST_HEAD(&bus->ports);
+	spin_lock_init(&bus->lock);
+	INIT_DELAYED_WORK(&bus->work, amzn_sfp_bus_work);
+	INIT_LIST_HEAD(&bus->accts);
+	bus->win_start = ktime_get_ns();
+	list_add_tail(&bus->link, &amzn_sfp_buses);
+
+ found:
+	spin_lock_bh(&bus->lock);
+	list_add_tail(&sc->bus_link, &bus->ports);
+	spin_unlock_bh(&bus->lock);
+	sc->bus = bus;
+	mutex_unlock(&amzn_sfp_buses_lock);
+	return 0;
+}
+
+/*
+ * Detach the port from its bus and wait for the bus worker to be done
+ * with it.  The last port to leave frees the bus.
+ */
+static void amzn_sfp_bus_detach(struct amzn_sfp_softc *sc)
+{
+	struct amzn_sfp_bus *bus = sc->bus;
+	struct amzn_sfp_gather_item *item, *tmp;
+	bool empty;
+
+	mutex_lock(&amzn_sfp_buses_lock);
+	spin_lock_bh(&bus->lock);
+	list_del(&sc->bus_link);
+	sc->tasks = 0;
+	empty = list_empty(&bus->ports);
+	spin_unlock_bh(&bus->lock);
+
+	if (empty) {
+		list_del(&bus->link);
+		cancel_delayed_work_sync(&bus->work);
+		amzn_sfp_acct_free(&bus->accts, &bus->nacct);
+		kfree(bus);
+	} else
+		flush_delayed_work(&bus->work);
+	mutex_unlock(&amzn_sfp_buses_lock);
+	sc->bus = NULL;
+
+	/* Fail whatever didn't get served. */
+	list_for_each_entry_safe(item, tmp, &sc->gather_items, link) {
+		list_del(&item->link);
+		amzn_sfp_gather_complete(item, -ENODEV);
+	}
+}
+
+static atomic64_t amzn_sfp_rounds = ATOMIC64_INIT(0);
+
+/*
+ * Hold off the current process while it's over its bus time quota on
+ * the bus of any of the ports of a gather, like amzn_sfp_throttle().
+ */
+static int amzn_sfp_gather_throttle(const struct amzn_sfp_gather *arg,
+    struct file *fp)
+{
+	struct amzn_sfp_owner owner;
+	struct amzn_sfp_softc *sc;
+	unsigned int port, wait;
+	int quota;
+
+	if (current->flags & PF_KTHREAD)
+		return 0;
+	amzn_sfp_owner_current(&owner);
+	for (;;) {
+		quota = READ_ONCE(amzn_sfp_client_quota_us);
+		if (quota <= 0)
+			return 0;
+		wait = 0;
+		mutex_lock(&amzn_sfp_ports_lock);
+		for (port = 0; port < AMZN_SFP_MAX_PORTS; port++) {
+			if (!(arg->ports[port / 64] & BIT_ULL(port % 64)))
+				continue;
+			sc = idr_find(&amzn_sfp_ports, port);
+			if (sc != NULL && sc->bus != NULL)
+				wait = max(wait, amzn_sfp_throttle_wait(sc->bus,
+				    &owner, quota));
+		}
+		mutex_unlock(&amzn_sfp_ports_lock);
+		if (wait == 0)
+			return 0;
+
+		if (fp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (msleep_interruptible(wait))
+			return -EINTR;
+	}
+}
+
+/*
+ * Read the same region from a set of ports.  The reads are queued on the
+ * bus workers, so that ports on different buses are read in parallel.
+ * A trigger time makes it a sampling round.  Copies the results out and
+ * sets the number of results; for rounds, also the spread of the read
+ * start times.  Like other reads, it's held off while the caller is over
+ * its bus time quota on any of the buses.
+ */
+static long amzn_sfp_gather_run(struct amzn_sfp_gather *arg, u64 trigger,
+    u64 *spread, struct file *fp)
+{
+	struct amzn_sfp_gather_result *res;
+	struct amzn_sfp_gather_item *item;
+	struct amzn_sfp_gather_req *req;
+	struct amzn_sfp_softc *sc;
+	unsigned int count, i, port;
+	unsigned long delay;
+	u64 first, last, now;
+	size_t stride;
+	long error;
+
+	if (arg->region.length == 0 || arg->region.reserved != 0)
+		return -EINVAL;
+	if (arg->region.length > AMZN_SFP_FULL_SIZE)
+		return -E2BIG;
+
+	count = 0;
+	for (i = 0; i < ARRAY_SIZE(arg->ports); i++)
+		count += hweight64(arg->ports[i]);
+	stride = AMZN_SFP_GATHER_STRIDE(arg->region.length);
+	if (count == 0)
+		return -EINVAL;
+	if ((size_t)arg->buflen < count * stride)
+		return -ENOSPC;
+	error = amzn_sfp_gather_throttle(arg, fp);
+	if (error)
+		return error;
+
+	req = kzalloc(struct_size(req, items, count), GFP_KERNEL);
+	if (req == NULL)
+		return -ENOMEM;
+	req->results = kvzalloc(count * stride, GFP_KERNEL);
+	if (req->results == NULL) {
+		kfree(req);
+		return -ENOMEM;
+	}
+	kref_init(&req->ref);
+	atomic_set(&req->pending, count + 1);
+	init_completion(&req->done);
+	req->trigger = trigger;
+	req->offset = arg->region.offset;
+	req->length = arg->region.length;
+	req->stride = stride;
+	amzn_sfp_owner_current(&req->owner);
+	now = ktime_get_ns();
+	delay = trigger > now ? nsecs_to_jiffies(trigger - now) : 0;
+
+	/*
+	 * Hold the port lock while queuing, so that ports can't go away
+	 * between looking them up and queuing the request on them.
+	 */
+	item = req->items;
+	mutex_lock(&amzn_sfp_ports_lock);
+	for (port = 0; port < AMZN_SFP_MAX_PORTS; port++) {
+		if (!(arg->ports[port / 64] & BIT_ULL(port % 64)))
+			continue;
+		item->req = req;
+		item->res = (void *)(req->results + (item - req->items) *
+		    stride);
+		item->res->port = port;
+		kref_get(&req->ref);
+
+		sc = idr_find(&amzn_sfp_ports, port);
+		if (sc == NULL) {
+			amzn_sfp_gather_complete(item, -ENODEV);
+		} else {
+			spin_lock_bh(&sc->bus->lock);
+			list_add_tail(&item->link, &sc->gather_items);
+			spin_unlock_bh(&sc->bus->lock);
+			amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_GATHER,
+			    delay);
+		}
+		item++;
+	}
+	mutex_unlock(&amzn_sfp_ports_lock);
+
+	/* Drop the reference that kept the request from completing early. */
+	if (!atomic_dec_and_test(&req->pending)) {
+		error = wait_for_completion_killable(&req->done);
+		if (error)
+			goto out;
+	}
+
+	if (spread != NULL) {
+		first = last = 0;
+		for (i = 0; i < count; i++) {
+			res = (void *)(req->results + i * stride);
+			if (res->status)
+				continue;
+			if (first == 0 || res->timestamp < first)
+				first = res->timestamp;
+			if (res->timestamp > last)
+				last = res->timestamp;
+		}
+		*spread = last - first;
+	}
+
+	error = 0;
+	if (copy_to_user(u64_to_user_ptr(arg->buf), req->results,
+	    count * stride))
+		error = -EFAULT;
+	arg->count = count;
+
+ out:
+	kref_put(&req->ref, amzn_sfp_gather_release);
+	return error;
+}
+
+/* AMZN_SFP_IOC_GATHER: read the same region from a set of ports. */
+static long amzn_sfp_ctl_gather(struct file *fp,
+    struct amzn_sfp_gather __user *uarg)
+{
+	struct amzn_sfp_gather arg;
+	long error;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	error = amzn_sfp_gather_run(&arg, 0, NULL, fp);
+	if (!error && put_user(arg.count, &uarg->count))
+		error = -EFAULT;
+	return error;
+}
+
+/*
+ * AMZN_SFP_IOC_ROUND: sample a set of ports at a common trigger time.
+ * A trigger in the past is now.
+ */
+static long amzn_sfp_ctl_round(struct file *fp,
+    struct amzn_sfp_round __user *uarg)
+{
+	struct amzn_sfp_round arg;
+	u64 now;
+	long error;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	now = ktime_get_ns();
+	if (arg.trigger > now + AMZN_SFP_ROUND_MAX_DELAY)
+		return -EINVAL;
+	arg.trigger = max(arg.trigger, now);
+
+	arg.round = atomic64_inc_return(&amzn_sfp_rounds);
+	error = amzn_sfp_gather_run(&arg.gather, arg.trigger, &arg.spread,
+	    fp);
+	if (!error && (put_user(arg.gather.count, &uarg->gather.count) ||
+	    put_user(arg.round, &uarg->round) ||
+	    put_user(arg.spread, &uarg->spread)))
+		error = -EFAULT;
+	return error;
+}
+
+static long amzn_sfp_ctl_ioctl(struct file *fp, unsigned int cmd,
+    unsigned long arg)
+{
+
+	switch (cmd) {
+	case AMZN_SFP_IOC_GATHER:
+		return amzn_sfp_ctl_gather(fp, (void __user *)arg);
+	case AMZN_SFP_IOC_ROUND:
+		return amzn_sfp_ctl_round(fp, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct file_operations amzn_sfp_ctl_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = amzn_sfp_ctl_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.llseek = noop_llseek,
+};
+
+/* /dev/amzn-sfp: operations that span ports. */
+static struct miscdevice amzn_sfp_ctl = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "amzn-sfp",
+	.fops = &amzn_sfp_ctl_fops,
+	.mode = 0644,
+};
+
+static int amzn_sfp_port_open(struct inode *inode, struct file *fp)
+{
+	struct amzn_sfp_softc *sc;
+	struct amzn_sfp_client *cl;
+	int error;
+
+	sc = container_of(inode->i_cdev, struct amzn_sfp_softc, cdev);
+	cl = kzalloc(sizeof(*cl), GFP_KERNEL);
+	if (cl == NULL)
+		return -ENOMEM;
+	error = kfifo_alloc(&cl->events, AMZN_SFP_EVENT_FIFO, GFP_KERNEL);
+	if (error) {
+		kfree(cl);
+		return error;
+	}
+	cl->sc = sc;
+	amzn_sfp_owner_current(&cl->owner);
+	spin_lock_init(&cl->ev_lock);
+	mutex_init(&cl->read_lock);
+	init_waitqueue_head(&cl->ev_wq);
+
+	rt_mutex_lock(&sc->lock);
+	error = sc->gone ? -ENODEV : amzn_sfp_image_alloc(sc);
+	if (!error)
+		list_add_tail(&cl->link, &sc->clients);
+	rt_mutex_unlock(&sc->lock);
+	if (error) {
+		kfifo_free(&cl->events);
+		kfree(cl);
+		return error;
+	}
+
+	fp->private_data = cl;
+	return nonseekable_open(inode, fp);
+}
+
+static int amzn_sfp_port_close(struct inode *inode, struct file *fp)
+{
+	struct amzn_sfp_client *cl = fp->private_data;
+	struct amzn_sfp_softc *sc = cl->sc;
+
+	rt_mutex_lock(&sc->lock);
+	list_del(&cl->link);
+	/* Sessions don't outlive the client that started them. */
+	if (sc->diag_client == cl)
+		amzn_sfp_diag_stop(sc);
+	/* On failure, the old plan stays; it just covers too much. */
+	if (cl->ninterests > 0 || cl->nthresholds > 0)
+		amzn_sfp_plan_build(sc);
+	if (cl->nflag_subs > 0 && !sc->gone &&
+	    sc->state == AMZN_SFP_STATE_READY)
+		amzn_sfp_masks_apply(sc, false);
+	rt_mutex_unlock(&sc->lock);
+
+	kfifo_free(&cl->events);
+	kfree(cl);
+	return 0;
+}
+
+/*
+ * Read whole events.  Once the port is gone, reads return what's left
+ * and then end-of-file.
+ */
+static ssize_t amzn_sfp_port_read(struct file *fp, char __user *buf,
+    size_t count, loff_t *ppos)
+{
+	struct amzn_sfp_client *cl = fp->private_data;
+	struct amzn_sfp_softc *sc = cl->sc;
+	struct amzn_sfp_event ev;
+	unsigned int copied;
+	size_t size, total;
+	int error;
+
+	if (mutex_lock_interruptible(&cl->read_lock))
+		return -ERESTARTSYS;
+	while (kfifo_is_empty(&cl->events)) {
+		mutex_unlock(&cl->read_lock);
+		if (READ_ONCE(sc->gone))
+			return 0;
+		if (fp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		error = wait_event_interruptible(cl->ev_wq,
+		    !kfifo_is_empty(&cl->events) || READ_ONCE(sc->gone));
+		if (error)
+			return error;
+		if (mutex_lock_interruptible(&cl->read_lock))
+			return -ERESTARTSYS;
+	}
+
+	total = 0;
+	error = 0;
+	while (!kfifo_is_empty(&cl->events)) {
+		kfifo_out_peek(&cl->events, &ev, sizeof(ev));
+		size = AMZN_SFP_EVENT_SIZE(ev.length);
+		if (size > count - total)
+			break;
+		error = kfifo_to_user(&cl->events, buf + total, size, &copied);
+		if (error)
+			break;
+		total += size;
+	}
+	mutex_unlock(&cl->read_lock);
+
+	if (total == 0 && error == 0)
+		error = -EINVAL;	/* Buffer too small for the event. */
+	return (total != 0) ? total : error;
+}
+
+static __poll_t amzn_sfp_port_poll(struct file *fp, poll_table *wait)
+{
+	struct amzn_sfp_client *cl = fp->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(fp, &cl->ev_wq, wait);
+	if (!kfifo_is_empty(&cl->events))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (READ_ONCE(cl->sc->gone))
+		mask |= EPOLLHUP;
+	return mask;
+}
+
+/*
+ * AMZN_SFP_IOC_INTEREST: add, change or remove an interest of the
+ * client and rebuild the poll plan of the port.
+ */
+static long amzn_sfp_port_interest(struct amzn_sfp_client *cl,
+    struct amzn_sfp_interest __user *uarg)
+{
+	struct amzn_sfp_interest saved[AMZN_SFP_MAX_INTERESTS];
+	struct amzn_sfp_softc *sc = cl->sc;
+	struct amzn_sfp_interest arg;
+	unsigned int k, nsaved;
+	long error;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.region.length == 0 || arg.region.reserved != 0 ||
+	    arg.reserved != 0)
+		return -EINVAL;
+	if (arg.region.offset >= sc->attr.size ||
+	    arg.region.length > sc->attr.size - arg.region.offset)
+		return -ESPIPE;
+	/* The data of the interest must fit the event queue. */
+	if (AMZN_SFP_EVENT_SIZE(arg.region.length) > AMZN_SFP_EVENT_FIFO)
+		return -E2BIG;
+	if (arg.interval_ms != 0)
+		arg.interval_ms = max_t(u32, arg.interval_ms,
+		    AMZN_SFP_MIN_INTERVAL_MS);
+
+	rt_mutex_lock(&sc->lock);
+	if (sc->gone) {
+		error = -ENODEV;
+		goto out;
+	}
+	for (k = 0; k < cl->ninterests; k++) {
+		if (cl->interests[k].region.offset == arg.region.offset &&
+		    cl->interests[k].region.length == arg.region.length)
+			break;
+	}
+	if (k == cl->ninterests && arg.interval_ms == 0) {
+		error = -ENOENT;
+		goto out;
+	}
+	if (k == AMZN_SFP_MAX_INTERESTS) {
+		error = -ENOSPC;
+		goto out;
+	}
+
+	memcpy(saved, cl->interests, sizeof(saved));
+	nsaved = cl->ninterests;
+	if (arg.interval_ms == 0) {
+		cl->interests[k] = cl->interests[--cl->ninterests];
+		cl->due[k] = cl->due[cl->ninterests];
+	} else {
+		if (k == cl->ninterests)
+			cl->ninterests++;
+		cl->interests[k] = arg;
+		cl->due[k] = jiffies;
+	}
+
+	error = amzn_sfp_plan_build(sc);
+	if (error) {
+		memcpy(cl->interests, saved, sizeof(saved));
+		cl->ninterests = nsaved;
+		goto out;
+	}
+	if (sc->nplan > 0)
+		amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_POLL, 0);
+
+ out:
+	rt_mutex_unlock(&sc->lock);
+	return error;
+}
+
+/* AMZN_SFP_IOC_THRESHOLD: add, change or remove a threshold. */
+static long amzn_sfp_port_threshold(struct amzn_sfp_client *cl,
+    struct amzn_sfp_threshold __user *uarg)
+{
+	struct amzn_sfp_threshold saved[AMZN_SFP_MAX_THRESHOLDS];
+	struct amzn_sfp_softc *sc = cl->sc;
+	struct amzn_sfp_threshold arg;
+	unsigned long saved_raised;
+	unsigned int k, nsaved;
+	long error;
+	bool low;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	low = arg.flags & AMZN_SFP_THRESH_LOW;
+	if (arg.reserved != 0 || (arg.size != 1 && arg.size != 2) ||
+	    (arg.flags & ~(AMZN_SFP_THRESH_SIGNED | AMZN_SFP_THRESH_LOW)) ||
+	    (low ? arg.clear < arg.set : arg.clear > arg.set))
+		return -EINVAL;
+	if (arg.offset >= sc->attr.size ||
+	    arg.size > sc->attr.size - arg.offset)
+		return -ESPIPE;
+	if (arg.interval_ms != 0)
+		arg.interval_ms = max_t(u32, arg.interval_ms,
+		    AMZN_SFP_MIN_INTERVAL_MS);
+
+	rt_mutex_lock(&sc->lock);
+	if (sc->gone) {
+		error = -ENODEV;
+		goto out;
+	}
+	for (k = 0; k < cl->nthresholds; k++) {
+		if (cl->thresholds[k].id == arg.id)
+			break;
+	}
+	if (k == cl->nthresholds && arg.interval_ms == 0) {
+		error = -ENOENT;
+		goto out;
+	}
+	if (k == AMZN_SFP_MAX_THRESHOLDS) {
+		error = -ENOSPC;
+		goto out;
+	}
+
+	memcpy(saved, cl->thresholds, sizeof(saved));
+	nsaved = cl->nthresholds;
+	saved_raised = cl->th_raised;
+	if (arg.interval_ms == 0) {
+		cl->thresholds[k] = cl->thresholds[--cl->nthresholds];
+		cl->th_due[k] = cl->th_due[cl->nthresholds];
+		if (test_bit(cl->nthresholds, &cl->th_raised))
+			__set_bit(k, &cl->th_raised);
+		else
+			__clear_bit(k, &cl->th_raised);
+		__clear_bit(cl->nthresholds, &cl->th_raised);
+	} else {
+		if (k == cl->nthresholds)
+			cl->nthresholds++;
+		cl->thresholds[k] = arg;
+		cl->th_due[k] = jiffies;
+		__clear_bit(k, &cl->th_raised);
+	}
+
+	error = amzn_sfp_plan_build(sc);
+	if (error) {
+		memcpy(cl->thresholds, saved, sizeof(saved));
+		cl->nthresholds = nsaved;
+		cl->th_raised = saved_raised;
+		goto out;
+	}
+	if (sc->nplan > 0)
+		amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_POLL, 0);
+
+ out:
+	rt_mutex_unlock(&sc->lock);
+	return error;
+}
+
+/*
+ * AMZN_SFP_IOC_FLAGS: add, change or remove a subscription to interrupt
+ * flags and update the masks of the module.  A module that isn't ready
+ * gets its masks when it is.
+ */
+static long amzn_sfp_port_flags(struct amzn_sfp_client *cl,
+    struct amzn_sfp_flags __user *uarg)
+{
+	struct amzn_sfp_softc *sc = cl->sc;
+	struct amzn_sfp_flags arg;
+	unsigned int k;
+	long error;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.length == 0 || arg.length > sizeof(arg.bits) ||
+	    arg.reserved != 0)
+		return -EINVAL;
+	if (arg.offset >= sc->attr.size ||
+	    arg.length > sc->attr.size - arg.offset)
+		return -ESPIPE;
+
+	rt_mutex_lock(&sc->lock);
+	if (sc->gone) {
+		error = -ENODEV;
+		goto out;
+	}
+	if (sc->backend == NULL || sc->backend->nmasks == 0) {
+		error = -EOPNOTSUPP;
+		goto out;
+	}
+	for (k = 0; k < cl->nflag_subs; k++) {
+		if (cl->flag_subs[k].offset == arg.offset &&
+		    cl->flag_subs[k].length == arg.length)
+			break;
+	}
+	if (memchr_inv(arg.bits, 0, arg.length) == NULL) {
+		if (k == cl->nflag_subs) {
+			error = -ENOENT;
+			goto out;
+		}
+		cl->flag_subs[k] = cl->flag_subs[--cl->nflag_subs];
+	} else {
+		if (k == AMZN_SFP_MAX_FLAG_SUBS) {
+			error = -ENOSPC;
+			goto out;
+		}
+		if (k == cl->nflag_subs)
+			cl->nflag_subs++;
+		cl->flag_subs[k] = arg;
+	}
+
+	error = 0;
+	if (sc->state == AMZN_SFP_STATE_READY)
+		error = amzn_sfp_masks_apply(sc, false);
+
+ out:
+	rt_mutex_unlock(&sc->lock);
+	return error;
+}
+
+/*
+ * AMZN_SFP_IOC_LANES: set the active lanes of the port, or have them
+ * follow the data path state of the module, and rebuild the poll plan.
+ */
+static long amzn_sfp_port_lanes(struct amzn_sfp_client *cl,
+    struct amzn_sfp_lanes __user *uarg)
+{
+	struct amzn_sfp_softc *sc = cl->sc;
+	const struct amzn_sfp_backend *be = sc->backend;
+	struct amzn_sfp_lanes arg;
+	long error;
+	u8 all;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.flags & ~AMZN_SFP_LANES_AUTO)
+		return -EINVAL;
+	if (be == NULL || be->nlanes == 0)
+		return -EOPNOTSUPP;
+	if ((arg.flags & AMZN_SFP_LANES_AUTO) &&
+	    sc->sfp_type != AMZN_SFP_TYPE_QSFP_DD)
+		return -EOPNOTSUPP;
+	all = GENMASK(be->nlanes - 1, 0);
+	if (!(arg.flags & AMZN_SFP_LANES_AUTO) && (arg.mask & ~all))
+		return -EINVAL;
+
+	rt_mutex_lock(&sc->lock);
+	if (sc->gone) {
+		error = -ENODEV;
+		goto out;
+	}
+	sc->lanes_auto = (arg.flags & AMZN_SFP_LANES_AUTO) != 0;
+	if (sc->lanes_auto) {
+		sc->lanes_due = jiffies;
+		if (sc->state == AMZN_SFP_STATE_READY)
+			amzn_sfp_lanes_refresh(sc);
+	} else if (sc->lanes_off != (~arg.mask & all)) {
+		sc->lanes_off = ~arg.mask & all;
+		amzn_sfp_plan_build(sc);
+	}
+	arg.mask = ~sc->lanes_off & all;
+	error = 0;
+	if (sc->nplan > 0)
+		amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_POLL, 0);
+
+ out:
+	rt_mutex_unlock(&sc->lock);
+	if (!error && copy_to_user(uarg, &arg, sizeof(arg)))
+		error = -EFAULT;
+	return error;
+}
+
+/*
+ * AMZN_SFP_IOC_TUNE: set the channel or wavelength of a tunable SFP+
+ * module.  Completion is polled for by the bus worker.
+ */
+static long amzn_sfp_port_tune(struct amzn_sfp_client *cl,
+    struct amzn_sfp_tune __user *uarg)
+{
+	struct amzn_sfp_softc *sc = cl->sc;
+	struct amzn_sfp_tune arg;
+	u8 buf[2], opt[2], reg, val;
+	long error;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.reserved != 0)
+		return -EINVAL;
+	switch (arg.flags) {
+	case AMZN_SFP_TUNE_CHANNEL:
+		reg = AMZN_SFF8690_CHANNEL;
+		put_unaligned_be16(arg.channel, buf);
+		break;
+	case AMZN_SFP_TUNE_WAVELENGTH:
+		reg = AMZN_SFF8690_WAVELENGTH;
+		put_unaligned_be16(arg.wavelength, buf);
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (sc->sfp_type != AMZN_SFP_TYPE_SFP_PLUS)
+		return -EOPNOTSUPP;
+
+	rt_mutex_lock(&sc->lock);
+	if (sc->gone) {
+		error = -ENODEV;
+		goto out;
+	}
+	if (sc->state != AMZN_SFP_STATE_READY &&
+	    sc->state != AMZN_SFP_STATE_UNKNOWN) {
+		error = -ENXIO;
+		goto out;
+	}
+	if (sc->tune_active) {
+		error = -EBUSY;
+		goto out;
+	}
+	/* The tuning registers need a usable, paged A2h. */
+	error = amzn_sfp_read_cached(sc, opt, AMZN_SFF8472_OPTIONS,
+	    sizeof(opt));
+	if (error)
+		goto out;
+	if (!(opt[1] & AMZN_SFF8472_OPT_TUNABLE) ||
+	    !(opt[0] & AMZN_SFF8472_OPT_PAGING) ||
+	    !sc->dm_valid || !AMZN_SFF8472_HAS_A2(sc->dm_type)) {
+		error = -EOPNOTSUPP;
+		goto out;
+	}
+
+	/* Clear stale latched status, then set the new channel. */
+	error = amzn_sfp_a2_rw(sc, AMZN_SFF8690_PAGE, AMZN_SFF8690_LATCHED,
+	    &val, 1, I2C_M_RD);
+	if (!error)
+		error = amzn_sfp_a2_rw(sc, AMZN_SFF8690_PAGE, reg, buf,
+		    sizeof(buf), 0);
+	if (error)
+		goto out;
+
+	sc->tune_active = true;
+	sc->tune_latched = 0;
+	sc->tune_poll_ms = AMZN_SFP_TUNE_POLL_MIN;
+	sc->tune_deadline = jiffies + msecs_to_jiffies(arg.timeout_ms ?
+	    arg.timeout_ms : AMZN_SFP_TUNE_TIMEOUT);
+	amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_TUNE,
+	    msecs_to_jiffies(AMZN_SFP_TUNE_POLL_MIN));
+
+ out:
+	rt_mutex_unlock(&sc->lock);
+	return error;
+}
+
+/* AMZN_SFP_IOC_BURST: start a burst capture. */
+static long amzn_sfp_port_burst(struct amzn_sfp_client *cl,
+    struct amzn_sfp_burst __user *uarg)
+{
+	struct amzn_sfp_softc *sc = cl->sc;
+	struct amzn_sfp_burst arg;
+	long error;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.count == 0 || arg.count > AMZN_SFP_HISTORY_LEN ||
+	    arg.interval_ms < AMZN_SFP_BURST_MIN_INTERVAL_MS ||
+	    (arg.flags & ~AMZN_SFP_BURST_LATCHED) || arg.reserved != 0)
+		return -EINVAL;
+
+	rt_mutex_lock(&sc->lock);
+	if (sc->gone)
+		error = -ENODEV;
+	else if (sc->burst_left != 0)
+		error = -EBUSY;
+	else
+		error = amzn_sfp_history_alloc(sc);
+	if (!error) {
+		sc->burst_left = arg.count;
+		sc->burst_interval_ms = arg.interval_ms;
+		sc->burst_flags = AMZN_SFP_SAMPLE_BURST;
+		if (arg.flags & AMZN_SFP_BURST_LATCHED)
+			sc->burst_flags |= AMZN_SFP_SAMPLE_LATCHED;
+		amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_BURST, 0);
+	}
+	rt_mutex_unlock(&sc->lock);
+	return error;
+}
+
+/* AMZN_SFP_IOC_HISTORY: copy out the samples in the history. */
+static long amzn_sfp_port_history(struct amzn_sfp_client *cl,
+    struct amzn_sfp_history __user *uarg)
+{
+	struct amzn_sfp_softc *sc = cl->sc;
+	struct amzn_sfp_history arg;
+	struct amzn_sfp_sample *smp;
+	unsigned int i, count, max;
+	u8 *samples = NULL;
+	size_t stride = 0;
+	long error = 0;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+
+	count = 0;
+	max = 0;
+	rt_mutex_lock(&sc->lock);
+	if (sc->history != NULL) {
+		stride = sc->hist_stride;
+		max = min_t(size_t, arg.buflen / stride, sc->hist_count);
+	}
+	if (max > 0) {
+		samples = kvmalloc(max * stride, GFP_KERNEL);
+		if (samples == NULL)
+			error = -ENOMEM;
+		for (i = 0; samples != NULL && i < sc->hist_count &&
+		    count < max; i++) {
+			smp = (void *)(sc->history + ((sc->hist_head +
+			    AMZN_SFP_HISTORY_LEN - sc->hist_count + i) %
+			    AMZN_SFP_HISTORY_LEN) * stride);
+			if (smp->timestamp <= arg.since)
+				continue;
+			memcpy(samples + count * stride, smp, stride);
+			count++;
+		}
+	}
+	rt_mutex_unlock(&sc->lock);
+
+	if (!error && count > 0 && copy_to_user(u64_to_user_ptr(arg.buf),
+	    samples, count * stride))
+		error = -EFAULT;
+	if (!error && put_user(count, &uarg->count))
+		error = -EFAULT;
+	kvfree(samples);
+	return error;
+}
+
+/* AMZN_SFP_IOC_PM: copy out the latest PM snapshot. */
+static long amzn_sfp_port_pm(struct amzn_sfp_client *cl,
+    struct amzn_sfp_pm __user *uarg)
+{
+	struct amzn_sfp_softc *sc = cl->sc;
+	struct amzn_sfp_pm arg;
+	u8 *snap;
+	long error = 0;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.buflen < AMZN_CMIS_PM_SIZE)
+		return -ENOSPC;
+	snap = kmalloc(AMZN_CMIS_PM_SIZE, GFP_KERNEL);
+	if (snap == NULL)
+		return -ENOMEM;
+
+	rt_mutex_lock(&sc->lock);
+	if (sc->backend != &amzn_cmis_backend || sc->pm_unsupported)
+		error = -EOPNOTSUPP;
+	else if (sc->pm == NULL || sc->pm_ts == 0)
+		error = -ENODATA;
+	else {
+		memcpy(snap, sc->pm, AMZN_CMIS_PM_SIZE);
+		arg.timestamp = sc->pm_ts;
+		arg.status = sc->pm_status;
+		arg.length = sc->pm_status ? 0 : AMZN_CMIS_PM_SIZE;
+	}
+	rt_mutex_unlock(&sc->lock);
+
+	if (!error && arg.length > 0 &&
+	    copy_to_user(u64_to_user_ptr(arg.buf), snap, arg.length))
+		error = -EFAULT;
+	if (!error && copy_to_user(uarg, &arg, sizeof(arg)))
+		error = -EFAULT;
+	kfree(snap);
+	return error;
+}
+
+/* AMZN_SFP_IOC_DIAG_START: start a diagnostic session. */
+static long amzn_sfp_port_diag_start(struct amzn_sfp_client *cl,
+    struct amzn_sfp_diag __user *uarg)
+{
+	struct amzn_sfp_softc *sc = cl->sc;
+	struct amzn_sfp_diag arg;
+	long error;
+	u8 val;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.reserved != 0 || arg.lanes == 0 || arg.pattern > 0xf ||
+	    !(arg.flags & AMZN_SFP_DIAG_GEN_MASK) ||
+	    (arg.flags & ~(AMZN_SFP_DIAG_GEN_MASK | AMZN_SFP_DIAG_LB_MASK)))
+		return -EINVAL;
+	if (arg.interval_ms != 0 && arg.interval_ms < AMZN_SFP_MIN_INTERVAL_MS)
+		return -EINVAL;
+
+	rt_mutex_lock(&sc->lock);
+	if (sc->gone) {
+		error = -ENODEV;
+		goto out;
+	}
+	if (sc->state != AMZN_SFP_STATE_READY) {
+		error = -ENXIO;
+		goto out;
+	}
+	if (sc->backend != &amzn_cmis_backend || sc->flat_mem) {
+		error = -EOPNOTSUPP;
+		goto out;
+	}
+	if (sc->diag_active) {
+		error = -EBUSY;
+		goto out;
+	}
+	error = amzn_sfp_read_cached(sc, &val, AMZN_CMIS_PAGES_SUPPORTED, 1);
+	if (error)
+		goto out;
+	if (!(val & AMZN_CMIS_DIAG_SUPPORTED)) {
+		error = -EOPNOTSUPP;
+		goto out;
+	}
+
+	error = amzn_sfp_diag_controls(sc, arg.flags, arg.lanes, arg.pattern);
+	if (error) {
+		amzn_sfp_diag_controls(sc, 0, 0, 0);
+		goto out;
+	}
+
+	memset(sc->diag_base, 0, sizeof(sc->diag_base));
+	memset(sc->diag_last, 0, sizeof(sc->diag_last));
+	sc->diag_active = true;
+	sc->diag_client = cl;
+	sc->diag_flags = arg.flags;
+	sc->diag_lanes = arg.lanes;
+	sc->diag_status = 0;
+	sc->diag_interval_ms = arg.interval_ms ? arg.interval_ms :
+	    AMZN_SFP_DIAG_INTERVAL;
+	sc->diag_deadline = arg.duration_ms ?
+	    jiffies + msecs_to_jiffies(arg.duration_ms) : 0;
+	sc->diag_start = sc->diag_ts = ktime_get_ns();
+	amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_DIAG,
+	    msecs_to_jiffies(sc->diag_interval_ms));
+
+ out:
+	rt_mutex_unlock(&sc->lock);
+	return error;
+}
+
+/*
+ * AMZN_SFP_IOC_DIAG_STOP: read the counters a last time and end the
+ * diagnostic session.  Stopping a session that already ended is fine.
+ */
+static long amzn_sfp_port_diag_stop(struct amzn_sfp_client *cl)
+{
+	struct amzn_sfp_softc *sc = cl->sc;
+	int error;
+
+	rt_mutex_lock(&sc->lock);
+	error = amzn_sfp_diag_stop(sc);
+	rt_mutex_unlock(&sc->lock);
+	return error;
+}
+
+/* AMZN_SFP_IOC_DIAG_RESULT: copy out the accumulated counters. */
+static long amzn_sfp_port_diag_result(struct amzn_sfp_client *cl,
+    struct amzn_sfp_diag_result __user *uarg)
+{
+	struct amzn_sfp_softc *sc = cl->sc;
+	struct amzn_sfp_diag_result res;
+	unsigned int side, lane;
+
+	memset(&res, 0, sizeof(res));
+	rt_mutex_lock(&sc->lock);
+	if (sc->diag_start == 0) {
+		rt_mutex_unlock(&sc->lock);
+		return -ENODATA;
+	}
+	res.start = sc->diag_start;
+	res.timestamp = sc->diag_ts;
+	res.status = sc->diag_status;
+	res.flags = sc->diag_flags;
+	res.lanes = sc->diag_lanes;
+	res.active = sc->diag_active;
+	for (side = 0; side < 2; side++) {
+		for (lane = 0; lane < AMZN_SFP_DIAG_LANES; lane++) {
+			res.counts[side][lane].errors =
+			    sc->diag_base[side][lane][0] +
+			    sc->diag_last[side][lane][0];
+			res.counts[side][lane].bits =
+			    sc->diag_base[side][lane][1] +
+			    sc->diag_last[side][lane][1];
+		}
+	}
+	rt_mutex_unlock(&sc->lock);
+
+	if (copy_to_user(uarg, &res, sizeof(res)))
+		return -EFAULT;
+	return 0;
+}
+
+static long amzn_sfp_port_ioctl(struct file *fp, unsigned int cmd,
+    unsigned long arg)
+{
+	struct amzn_sfp_client *cl = fp->private_data;
+
+	/* Changing the state of the module takes a writable port. */
+	if ((cmd == AMZN_SFP_IOC_TUNE || cmd == AMZN_SFP_IOC_DIAG_START ||
+	    cmd == AMZN_SFP_IOC_DIAG_STOP) && !(fp->f_mode & FMODE_WRITE))
+		return -EBADF;
+
+	switch (cmd) {
+	case AMZN_SFP_IOC_INTEREST:
+		return amzn_sfp_port_interest(cl, (void __user *)arg);
+	case AMZN_SFP_IOC_TUNE:
+		return amzn_sfp_port_tune(cl, (void __user *)arg);
+	case AMZN_SFP_IOC_BURST:
+		return amzn_sfp_port_burst(cl, (void __user *)arg);
+	case AMZN_SFP_IOC_HISTORY:
+		return amzn_sfp_port_history(cl, (void __user *)arg);
+	case AMZN_SFP_IOC_PM:
+		return amzn_sfp_port_pm(cl, (void __user *)arg);
+	case AMZN_SFP_IOC_DIAG_START:
+		return amzn_sfp_port_diag_start(cl, (void __user *)arg);
+	case AMZN_SFP_IOC_DIAG_STOP:
+		return amzn_sfp_port_diag_stop(cl);
+	case AMZN_SFP_IOC_DIAG_RESULT:
+		return amzn_sfp_port_diag_result(cl, (void __user *)arg);
+	case AMZN_SFP_IOC_THRESHOLD:
+		return amzn_sfp_port_threshold(cl, (void __user *)arg);
+	case AMZN_SFP_IOC_FLAGS:
+		return amzn_sfp_port_flags(cl, (void __user *)arg);
+	case AMZN_SFP_IOC_LANES:
+		return amzn_sfp_port_lanes(cl, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* The image can only be mapped read-only and shared. */
+static int amzn_sfp_port_mmap(struct file *fp, struct vm_area_struct *vma)
+{
+	struct amzn_sfp_client *cl = fp->private_data;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	return remap_vmalloc_range(vma, cl->sc->image, vma->vm_pgoff);
+}
+
+/* /dev/amzn-sfp<port_id>: operations on one port. */
+static const struct file_operations amzn_sfp_port_fops = {
+	.owner = THIS_MODULE,
+	.open = amzn_sfp_port_open,
+	.release = amzn_sfp_port_close,
+	.read = amzn_sfp_port_read,
+	.poll = amzn_sfp_port_poll,
+	.unlocked_ioctl = amzn_sfp_port_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.mmap = amzn_sfp_port_mmap,
+	.llseek = no_llseek,
+};
+
+/*
+ * The softc lives as long as the port device, which open files of the
+ * port device hold a reference to.  It can outlive the I2C client.
+ */
+static void amzn_sfp_port_release(struct device *dev)
+{
+	struct amzn_sfp_softc *sc;
+
+	sc = container_of(dev, struct amzn_sfp_softc, dev);
+	xa_destroy(&sc->cache);
+	vfree(sc->image);
+	kvfree(sc->poll_data);
+	kvfree(sc->history);
+	kfree(sc->pm);
+	kfree(sc->plan);
+	kfree(sc->xfer_buf);
+	kvfree(sc->dump);
+	amzn_sfp_acct_free(&sc->accts, &sc->nacct);
+	kfree(sc);
+}
+
+static ssize_t state_show(struct device *dev, struct device_attribute *attr,
+    char *buf)
+{
+	struct amzn_sfp_softc *sc = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%s\n", amzn_sfp_state_names[READ_ONCE(sc->state)]);
+}
+static DEVICE_ATTR_RO(state);
+
+/*
+ * Show one of the identity strings.  Readers block until the module
+ * has been identified.
+ */
+static ssize_t amzn_sfp_ident_show(struct device *dev, char *buf,
+    size_t field)
+{
+	struct amzn_sfp_softc *sc = dev_get_drvdata(dev);
+	ssize_t result;
+	int error;
+
+	error = amzn_sfp_wait_ready(sc, NULL);
+	if (error)
+		return error;
+
+	rt_mutex_lock(&sc->lock);
+	if (sc->id_valid)
+		result = sprintf(buf, "%s\n", (char *)&sc->ident + field);
+	else
+		result = -ENODATA;
+	rt_mutex_unlock(&sc->lock);
+	return result;
+}
+
+#define	AMZN_SFP_IDENT_ATTR(_name)					\
+static ssize_t _name##_show(struct device *dev,				\
+    struct device_attribute *attr, char *buf)				\
+{									\
+	return amzn_sfp_ident_show(dev, buf,				\
+	    offsetof(struct amzn_sfp_ident, _name));			\
+}									\
+static DEVICE_ATTR_RO(_name)
+
+AMZN_SFP_IDENT_ATTR(vendor_name);
+AMZN_SFP_IDENT_ATTR(vendor_pn);
+AMZN_SFP_IDENT_ATTR(vendor_rev);
+AMZN_SFP_IDENT_ATTR(vendor_sn);
+AMZN_SFP_IDENT_ATTR(date_code);
+
+static ssize_t identifier_show(struct device *dev,
+    struct device_attribute *attr, char *buf)
+{
+	struct amzn_sfp_softc *sc = dev_get_drvdata(dev);
+	ssize_t result;
+	int error;
+
+	error = amzn_sfp_wait_ready(sc, NULL);
+	if (error)
+		return error;
+
+	rt_mutex_lock(&sc->lock);
+	if (sc->id_valid)
+		result = sprintf(buf, "0x%02x\n", sc->ident.identifier);
+	else
+		result = -ENODATA;
+	rt_mutex_unlock(&sc->lock);
+	return result;
+}
+static DEVICE_ATTR_RO(identifier);
+
+/*
+ * How the monitors of the module are calibrated: "internal", "external"
+ * (SFF-8472 only), or "none" for SFP+ modules without usable A2h.
+ */
+static ssize_t calibration_show(struct device *dev,
+    struct device_attribute *attr, char *buf)
+{
+	struct amzn_sfp_softc *sc = dev_get_drvdata(dev);
+	const char *cal = "internal";
+	ssize_t result;
+	int error;
+
+	error = amzn_sfp_wait_ready(sc, NULL);
+	if (error)
+		return error;
+
+	rt_mutex_lock(&sc->lock);
+	if (!sc->id_valid)
+		result = -ENODATA;
+	else {
+		if (sc->sfp_type == AMZN_SFP_TYPE_SFP_PLUS &&
+		    !AMZN_SFF8472_HAS_A2(sc->dm_type))
+			cal = "none";
+		else if (sc->sfp_type == AMZN_SFP_TYPE_SFP_PLUS &&
+		    (sc->dm_type & AMZN_SFF8472_DIAG_EXTERNAL))
+			cal = "external";
+		result = sprintf(buf, "%s\n", cal);
+	}
+	rt_mutex_unlock(&sc->lock);
+	return result;
+}
+static DEVICE_ATTR_RO(calibration);
+
+static ssize_t port_id_show(struct device *dev, struct device_attribute *attr,
+    char *buf)
+{
+	struct amzn_sfp_softc *sc = dev_get_drvdata(dev);
 
-		/*
-		 * Don't write the page select register if the desired
-		 * page is the same as the current page.
-		 */
-		if (iobuf[1] == sc->cur_page)
-			break;
+	return sprintf(buf, "%d\n", sc->port_id);
+}
+static DEVICE_ATTR_RO(port_id);
 
-		/*
-		 * Write the page select register.  We have a lock on
-		 * the device, so we know the page can not be changed
-		 * between now and when we access the page.
-		 */
-		nmsgs = 0;
-		msg[nmsgs].addr = addr;
-		msg[nmsgs].flags = 0;
-		msg[nmsgs].len = 2;
-		msg[nmsgs].buf = iobuf;
-		nmsgs++;
+/*
+ * The halves a ready module advertises, in ascending order, so that a
+ * dump selects every page only once.  Called with the softc lock held.
+ */
+static int amzn_sfp_dump_halves(struct amzn_sfp_softc *sc, u32 *halves)
+{
+	unsigned int groups, page, n = 0;
+	int error;
+	u8 val;
 
-		error = i2c_transfer(client->adapter, msg, nmsgs);
-		if (error < 0) {
-			/* Don't trust our state. */
-			sc->cur_page = -1;
-			rt_mutex_unlock(&sc->lock);
-			return error;
+	halves[n++] = 0;
+	halves[n++] = AMZN_SFP_HALF_SIZE;
+	switch (sc->sfp_type) {
+	case AMZN_SFP_TYPE_SFP_PLUS:
+		if (AMZN_SFF8472_HAS_A2(sc->dm_type)) {
+			halves[n++] = AMZN_SFF8472_A2;
+			halves[n++] = AMZN_SFF8472_A2 + AMZN_SFP_HALF_SIZE;
 		}
-
-		sc->cur_page = iobuf[1];
-		sc->cur_page_ts = jiffies;
 		break;
-	default:
+	case AMZN_SFP_TYPE_QSFP_PLUS:
+	case AMZN_SFP_TYPE_QSFP28:
+		if (sc->flat_mem)
+			break;
+		error = amzn_sfp_read_cached(sc, &val, AMZN_SFF8636_OPTIONS, 1);
+		if (error)
+			return error;
+		if (val & AMZN_SFF8636_OPT_PAGE01)
+			halves[n++] = AMZN_SFP_PAGE(0x01);
+		if (val & AMZN_SFF8636_OPT_PAGE02)
+			halves[n++] = AMZN_SFP_PAGE(0x02);
+		halves[n++] = AMZN_SFP_PAGE(0x03);
+		break;
+	case AMZN_SFP_TYPE_QSFP_DD:
+		if (sc->flat_mem)
+			break;
+		error = amzn_sfp_read_cached(sc, &val,
+		    AMZN_CMIS_PAGES_SUPPORTED, 1);
+		if (error)
+			return error;
+		halves[n++] = AMZN_SFP_PAGE(0x01);
+		halves[n++] = AMZN_SFP_PAGE(0x02);
+		if (val & AMZN_CMIS_PAGE03_SUPPORTED)
+			halves[n++] = AMZN_SFP_PAGE(0x03);
+		halves[n++] = AMZN_SFP_PAGE(0x10);
+		halves[n++] = AMZN_SFP_PAGE(0x11);
+		if (val & AMZN_CMIS_DIAG_SUPPORTED) {
+			halves[n++] = AMZN_SFP_PAGE(AMZN_CMIS_DIAG_PAGE);
+			halves[n++] = AMZN_SFP_PAGE(AMZN_CMIS_RESULT_PAGE);
+		}
+		if (!(val & AMZN_CMIS_VDM_SUPPORTED))
+			break;
+		error = amzn_sfp_read_cached(sc, &val,
+		    AMZN_SFP_PAGE_OFFSET(AMZN_CMIS_VDM_PAGE,
+		    AMZN_CMIS_VDM_GROUPS), 1);
+		if (error)
+			return error;
 		/*
-		 * Unknown SFP type, we simply give access to the full
-		 * EEPROM, without any knowledge about.  You get what
-		 * you get...
+		 * Group g has pages 20h + g, 24h + g and 28h + g; the
+		 * flags on page 2Ch, the masks on page 2Dh and the controls
+		 * on page 2Fh are shared.  Page 2Eh is reserved.
 		 */
-		reg = ofs;
+		groups = (val & 0x03) + 1;
+		for (page = 0x20; page < AMZN_CMIS_VDM_FLAGS_PAGE; page++) {
+			if ((page - 0x20) % 4 < groups)
+				halves[n++] = AMZN_SFP_PAGE(page);
+		}
+		halves[n++] = AMZN_SFP_PAGE(AMZN_CMIS_VDM_FLAGS_PAGE);
+		halves[n++] = AMZN_SFP_PAGE(AMZN_CMIS_VDM_MASKS_PAGE);
+		halves[n++] = AMZN_SFP_PAGE(AMZN_CMIS_VDM_PAGE);
 		break;
 	}
+	return n;
+}
 
-	/*
-	 * The SPI-I2C controller has a limited buffer
-	 * size (96 bytes) and the driver simply returns EOPNOTSUPP when
-	 * a larger transfer is requested.  Bad driver!
-	 */
-	if (len > 64)
-		len = 64;
+/*
+ * Take a new image of the module for the 'dump' file, in one hold of
+ * the softc lock.  Called with the softc lock held.
+ */
+static int amzn_sfp_dump_take(struct amzn_sfp_softc *sc)
+{
+	const struct amzn_sfp_ident *id = &sc->ident;
+	u32 halves[AMZN_SFP_DUMP_MAX_HALVES];
+	struct amzn_sfp_dump_half *tab;
+	struct amzn_sfp_dump_hdr *hdr;
+	loff_t ofs, end, rend;
+	u8 *dump, *data;
+	size_t size;
+	int error, i, n;
 
-	nmsgs = 0;
-	if (flags == I2C_M_RD) {
-		msg[nmsgs].addr = addr;
-		msg[nmsgs].flags = 0;
-		msg[nmsgs].len = 1;
-		msg[nmsgs].buf = &reg;
-		nmsgs++;
-		msg[nmsgs].addr = addr;
-		msg[nmsgs].flags = flags;
-		msg[nmsgs].len = len;
-		msg[nmsgs].buf = buf;
-		nmsgs++;
-	} else {
-		iobuf[0] = reg;
-		memcpy(iobuf + 1, buf, len);
-		msg[nmsgs].addr = addr;
-		msg[nmsgs].flags = 0;
-		msg[nmsgs].len = len + 1;
-		msg[nmsgs].buf = iobuf;
-		nmsgs++;
+	if (sc->gone)
+		return -ENODEV;
+	if (!sc->id_valid || sc->backend == NULL)
+		return -ENODATA;
+	n = amzn_sfp_dump_halves(sc, halves);
+	if (n < 0)
+		return n;
+
+	size = sizeof(*hdr) + n * (sizeof(*tab) + AMZN_SFP_HALF_SIZE);
+	dump = kvzalloc(size, GFP_KERNEL);
+	if (dump == NULL)
+		return -ENOMEM;
+	hdr = (void *)dump;
+	tab = (void *)(hdr + 1);
+	data = (u8 *)(tab + n);
+	hdr->magic = AMZN_SFP_DUMP_MAGIC;
+	hdr->version = AMZN_SFP_DUMP_VERSION;
+	hdr->halves = n;
+	hdr->table_offset = sizeof(*hdr);
+	hdr->data_offset = data - dump;
+	hdr->timestamp = ktime_get_ns();
+	strscpy(hdr->backend, sc->backend->name, sizeof(hdr->backend));
+	hdr->identifier = id->identifier;
+	hdr->fingerprint = id->fingerprint;
+	strscpy(hdr->vendor_name, id->vendor_name, sizeof(hdr->vendor_name));
+	strscpy(hdr->vendor_pn, id->vendor_pn, sizeof(hdr->vendor_pn));
+	strscpy(hdr->vendor_rev, id->vendor_rev, sizeof(hdr->vendor_rev));
+	strscpy(hdr->vendor_sn, id->vendor_sn, sizeof(hdr->vendor_sn));
+	strscpy(hdr->date_code, id->date_code, sizeof(hdr->date_code));
+
+	for (i = 0; i < n; i++, data += AMZN_SFP_HALF_SIZE) {
+		tab[i].offset = halves[i];
+		tab[i].timestamp = ktime_get_ns();
+		end = halves[i] + AMZN_SFP_HALF_SIZE;
+		for (ofs = halves[i]; ofs < end; ofs = rend) {
+			if (amzn_sfp_range_kind(sc, ofs, &rend) ==
+			    AMZN_SFP_RANGE_NOCACHE) {
+				tab[i].flags |= AMZN_SFP_DUMP_HALF_PARTIAL;
+				rend = min(rend, end);
+				continue;
+			}
+			rend = min(rend, end);
+			error = amzn_sfp_read_locked(sc,
+			    data + (ofs - halves[i]), ofs, rend - ofs);
+			if (error) {
+				kvfree(dump);
+				return error;
+			}
+		}
 	}
-	/* Writing to page select byte and immediate read to that same page 
-	 * cause certain modules to hang. Wait 4 - 5ms for modules to load 
-	 * upper page eeprom
+
+	kvfree(sc->dump);
+	sc->dump = dump;
+	sc->dump_len = size;
+	return 0;
+}
+
+static ssize_t dump_read(struct file *fp, struct kobject *kobj,
+    struct bin_attribute *ba, char *buf, loff_t ofs, size_t len)
+{
+	struct amzn_sfp_softc *sc = dev_get_drvdata(kobj_to_dev(kobj));
+	ssize_t result;
+	int error;
+
+	if (ofs == 0) {
+		error = amzn_sfp_wait_ready(sc, fp);
+		if (!error)
+			error = amzn_sfp_throttle(sc, fp);
+		if (error)
+			return error;
+	}
+
+	rt_mutex_lock(&sc->lock);
+	/*
+	 * The image belongs to the open file that took it until that has
+	 * read all of it or stopped reading for a while, so that readers
+	 * never get pieces of different images.
 	 */
-	ts = sc->cur_page_ts + msecs_to_jiffies(amzn_sfp_page_load_wait_ms);
-	if (time_in_range(jiffies, sc->cur_page_ts, ts)) {
-		ts = amzn_sfp_page_load_wait_ms * 1000;
-		usleep_range(ts, ts + 1000);
+	if (sc->dump != NULL && sc->dump_fp != fp &&
+	    (ofs != 0 || (sc->dump_next < sc->dump_len &&
+	    time_before(jiffies, sc->dump_used +
+	    msecs_to_jiffies(AMZN_SFP_DUMP_HOLD_MS))))) {
+		rt_mutex_unlock(&sc->lock);
+		return -EBUSY;
 	}
+	result = (ofs == 0) ? amzn_sfp_dump_take(sc) : 0;
+	if (result == 0 && ofs == 0)
+		sc->dump_fp = fp;
+	if (result == 0 && sc->dump != NULL && ofs < sc->dump_len) {
+		result = min_t(size_t, len, sc->dump_len - ofs);
+		memcpy(buf, sc->dump + ofs, result);
+		sc->dump_next = ofs + result;
+		sc->dump_used = jiffies;
+	}
+	rt_mutex_unlock(&sc->lock);
+	return result;
+}
+static BIN_ATTR_RO(dump, 0);
 
-	error = i2c_transfer(client->adapter, msg, nmsgs);
+static struct bin_attribute *amzn_sfp_bin_attrs[] = {
+	&bin_attr_dump,
+	NULL
+};
 
-	rt_mutex_unlock(&sc->lock);
+static struct attribute *amzn_sfp_attrs[] = {
+	&dev_attr_state.attr,
+	&dev_attr_port_id.attr,
+	&dev_attr_identifier.attr,
+	&dev_attr_calibration.attr,
+	&dev_attr_vendor_name.attr,
+	&dev_attr_vendor_pn.attr,
+	&dev_attr_vendor_rev.attr,
+	&dev_attr_vendor_sn.attr,
+	&dev_attr_date_code.attr,
+	NULL
+};
 
-	if (error < 0)
-		return error;
-	if (error != nmsgs)
-		return -EPIPE;
-	return (ssize_t)len;
-}
+static const struct attribute_group amzn_sfp_attr_group = {
+	.attrs = amzn_sfp_attrs,
+	.bin_attrs = amzn_sfp_bin_attrs,
+};
 
 static ssize_t amzn_sfp_read(struct file *fp, struct kobject *kobj,
     struct bin_attribute *ba, char *buf, loff_t ofs, size_t len)
 {
 	ssize_t result;
 
-	result = amzn_sfp_rw(ba, buf, ofs, len, I2C_M_RD);
+	result = amzn_sfp_rw(ba, fp, buf, ofs, len, I2C_M_RD);
 	return result;
 }
 
@@ -317,13 +5489,206 @@ static ssize_t amzn_sfp_write(struct file *fp, struct kobject *kobj,
 {
 	ssize_t result;
 
-	result = amzn_sfp_rw(ba, buf, ofs, len, 0);
+	result = amzn_sfp_rw(ba, fp, buf, ofs, len, 0);
 	return result;
 }
 
+/*
+ * Read the bitmaps of a presence provider and tell the ports bound to it
+ * what changed.  Presence changes kick the presence task of the port;
+ * IntL is serviced for ports that don't have an interrupt of their own.
+ */
+static void amzn_sfp_presence_work(struct work_struct *work)
+{
+	struct amzn_sfp_presence *prov = container_of(to_delayed_work(work),
+	    struct amzn_sfp_presence, work);
+	struct amzn_sfp_softc *sc;
+	u64 present = 0, intl = 0, changed;
+	int error;
+
+	error = prov->read(prov, &present, &intl);
+	mutex_lock(&amzn_sfp_presence_lock);
+	if (error) {
+		pr_warn_ratelimited("amzn-sfp: unable to read presence "
+		    "provider %s (error %d)\n", prov->name, error);
+	} else {
+		changed = prov->valid ? present ^ prov->present : ~0ULL;
+		prov->present = present;
+		prov->valid = true;
+		list_for_each_entry(sc, &prov->ports, prov_link) {
+			WRITE_ONCE(sc->prov_present,
+			    (present >> sc->prov_bit) & 1);
+			if ((changed >> sc->prov_bit) & 1)
+				amzn_sfp_task_schedule(sc,
+				    AMZN_SFP_TASK_PRESENCE, 0);
+			if (((intl >> sc->prov_bit) & 1) && sc->irq <= 0)
+				amzn_sfp_intl_assert(sc);
+		}
+	}
+	mutex_unlock(&amzn_sfp_presence_lock);
+
+	if (READ_ONCE(amzn_sfp_presence_poll_ms) > 0)
+		queue_delayed_work(amzn_sfp_wq, &prov->work,
+		    msecs_to_jiffies(amzn_sfp_presence_poll_ms));
+}
+
+int amzn_sfp_presence_register(struct amzn_sfp_presence *prov)
+{
+	struct amzn_sfp_presence *p;
+
+	if (prov->name == NULL || prov->read == NULL || prov->nbits == 0 ||
+	    prov->nbits > AMZN_SFP_PRESENCE_BITS)
+		return -EINVAL;
+	INIT_LIST_HEAD(&prov->ports);
+	INIT_DELAYED_WORK(&prov->work, amzn_sfp_presence_work);
+	prov->valid = false;
+
+	mutex_lock(&amzn_sfp_presence_lock);
+	list_for_each_entry(p, &amzn_sfp_providers, link) {
+		if (strcmp(p->name, prov->name) == 0) {
+			mutex_unlock(&amzn_sfp_presence_lock);
+			return -EEXIST;
+		}
+	}
+	list_add_tail(&prov->link, &amzn_sfp_providers);
+	mutex_unlock(&amzn_sfp_presence_lock);
+
+	queue_delayed_work(amzn_sfp_wq, &prov->work, 0);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(amzn_sfp_presence_register);
+
+/* Ports bound to the provider fall back to probing their modules. */
+void amzn_sfp_presence_unregister(struct amzn_sfp_presence *prov)
+{
+	struct amzn_sfp_softc *sc, *tmp;
+
+	mutex_lock(&amzn_sfp_presence_lock);
+	list_del(&prov->link);
+	list_for_each_entry_safe(sc, tmp, &prov->ports, prov_link) {
+		list_del(&sc->prov_link);
+		rt_mutex_lock(&sc->lock);
+		sc->prov = NULL;
+		rt_mutex_unlock(&sc->lock);
+	}
+	mutex_unlock(&amzn_sfp_presence_lock);
+	cancel_delayed_work_sync(&prov->work);
+}
+EXPORT_SYMBOL_GPL(amzn_sfp_presence_unregister);
+
+void amzn_sfp_presence_changed(struct amzn_sfp_presence *prov)
+{
+
+	mod_delayed_work(amzn_sfp_wq, &prov->work, 0);
+}
+EXPORT_SYMBOL_GPL(amzn_sfp_presence_changed);
+
+/* Read a bitmap spread over consecutive registers. */
+static int amzn_sfp_regmap_bits(struct amzn_sfp_presence_regmap *rp,
+    unsigned int reg, u64 *bits)
+{
+	unsigned int i, val;
+	u64 v = 0;
+	int error, width;
+
+	width = regmap_get_val_bytes(rp->map) * 8;
+	if (width <= 0)
+		return -EINVAL;
+	for (i = 0; i * width < rp->prov.nbits; i++) {
+		error = regmap_read(rp->map, reg + i * rp->stride, &val);
+		if (error)
+			return error;
+		v |= (u64)val << (i * width);
+	}
+	if (rp->active_low)
+		v = ~v;
+	*bits = v & GENMASK_ULL(rp->prov.nbits - 1, 0);
+	return 0;
+}
+
+static int amzn_sfp_presence_regmap_read(struct amzn_sfp_presence *prov,
+    u64 *present, u64 *intl)
+{
+	struct amzn_sfp_presence_regmap *rp = container_of(prov,
+	    struct amzn_sfp_presence_regmap, prov);
+	int error;
+
+	error = amzn_sfp_regmap_bits(rp, rp->present_reg, present);
+	if (!error && rp->has_intl)
+		error = amzn_sfp_regmap_bits(rp, rp->intl_reg, intl);
+	return error;
+}
+
+int amzn_sfp_presence_regmap_register(struct amzn_sfp_presence_regmap *rp)
+{
+
+	if (rp->map == NULL)
+		return -EINVAL;
+	if (rp->stride == 0)
+		rp->stride = 1;
+	rp->prov.read = amzn_sfp_presence_regmap_read;
+	return amzn_sfp_presence_register(&rp->prov);
+}
+EXPORT_SYMBOL_GPL(amzn_sfp_presence_regmap_register);
+
+/*
+ * Bind the port to the presence provider named in the firmware
+ * description of its module, if any.  Defers the probe until the
+ * provider is registered.
+ */
+static int amzn_sfp_presence_bind(struct amzn_sfp_softc *sc)
+{
+	struct device *dev = &sc->client->dev;
+	struct amzn_sfp_presence *p;
+	const char *name;
+	int error = -EPROBE_DEFER;
+	u32 bit;
+
+	if (device_property_read_string(dev, "amzn,presence", &name))
+		return 0;
+	if (device_property_read_u32(dev, "amzn,presence-bit", &bit)) {
+		dev_err(dev, "amzn,presence without amzn,presence-bit\n");
+		return -EINVAL;
+	}
+
+	mutex_lock(&amzn_sfp_presence_lock);
+	list_for_each_entry(p, &amzn_sfp_providers, link) {
+		if (strcmp(p->name, name) != 0)
+			continue;
+		if (bit >= p->nbits) {
+			dev_err(dev, "presence bit %u beyond provider %s\n",
+			    bit, name);
+			error = -EINVAL;
+			break;
+		}
+		sc->prov = p;
+		sc->prov_bit = bit;
+		sc->prov_present = p->valid && ((p->present >> bit) & 1);
+		list_add_tail(&sc->prov_link, &p->ports);
+		error = 0;
+		break;
+	}
+	mutex_unlock(&amzn_sfp_presence_lock);
+	return error;
+}
+
+static void amzn_sfp_presence_unbind(struct amzn_sfp_softc *sc)
+{
+
+	mutex_lock(&amzn_sfp_presence_lock);
+	if (sc->prov != NULL) {
+		list_del(&sc->prov_link);
+		rt_mutex_lock(&sc->lock);
+		sc->prov = NULL;
+		rt_mutex_unlock(&sc->lock);
+	}
+	mutex_unlock(&amzn_sfp_presence_lock);
+}
+
 static int amzn_sfp_probe(struct i2c_client *client,
     const struct i2c_device_id *id)
 {
+	const struct i2c_adapter_quirks *quirks;
 	struct amzn_sfp_softc *sc;
 	int error;
 
@@ -331,14 +5696,24 @@ static int amzn_sfp_probe(struct i2c_client *client,
 	if (client == NULL || id == NULL)
 		return -EINVAL;
 
-	sc = devm_kzalloc(&client->dev, sizeof(*sc), GFP_KERNEL);
+	sc = kzalloc(sizeof(*sc), GFP_KERNEL);
 	if (sc == NULL)
 		return -ENOMEM;
+	device_initialize(&sc->dev);
+	sc->dev.release = amzn_sfp_port_release;
 
 	sc->client = client;
 	rt_mutex_init(&sc->lock);
+	xa_init(&sc->cache);
 	sc->sfp_type = id->driver_data;
 	sc->cur_page = -1;	/* We don't know */
+	sc->state = AMZN_SFP_STATE_UNKNOWN;
+	sc->ready_poll_ms = AMZN_SFP_READY_POLL_MIN;
+	init_waitqueue_head(&sc->state_wq);
+	INIT_LIST_HEAD(&sc->bus_link);
+	INIT_LIST_HEAD(&sc->gather_items);
+	INIT_LIST_HEAD(&sc->clients);
+	INIT_LIST_HEAD(&sc->accts);
 	i2c_set_clientdata(client, sc);
 
 	sysfs_bin_attr_init(&sc->attr);
@@ -353,6 +5728,7 @@ static int amzn_sfp_probe(struct i2c_client *client,
 		 * increment to select the I2C device.
 		 */
 		sc->attr.size = 2 * AMZN_SFP_FULL_SIZE;
+		sc->backend = &amzn_sff8472_backend;
 		break;
 	case AMZN_SFP_TYPE_QSFP_PLUS:
 	case AMZN_SFP_TYPE_QSFP28:
@@ -368,6 +5744,8 @@ static int amzn_sfp_probe(struct i2c_client *client,
 		 * select and the register access on that page.
 		 */
 		sc->attr.size = 257 * AMZN_SFP_HALF_SIZE;
+		sc->backend = (sc->sfp_type == AMZN_SFP_TYPE_QSFP_DD) ?
+		    &amzn_cmis_backend : &amzn_sff8636_backend;
 		break;
 	default:
 		dev_warn(&client->dev, "unknown SFP type %d; fix driver\n",
@@ -375,21 +5753,119 @@ static int amzn_sfp_probe(struct i2c_client *client,
 		sc->attr.size = AMZN_SFP_FULL_SIZE;
 		break;
 	}
+	sc->max_xfer = AMZN_SFP_MAX_XFER;
+	quirks = client->adapter->quirks;
+	if (quirks != NULL && quirks->max_read_len != 0)
+		sc->max_xfer = min_t(size_t, sc->max_xfer,
+		    quirks->max_read_len);
+	/* Writes send the register address ahead of the data. */
+	sc->max_wxfer = sc->max_xfer;
+	if (quirks != NULL && quirks->max_write_len > 1)
+		sc->max_wxfer = min_t(size_t, sc->max_wxfer,
+		    quirks->max_write_len - 1);
+	sc->xfer_buf = kmalloc(AMZN_SFP_XFER_DATA + sc->max_xfer, GFP_KERNEL);
+	if (sc->xfer_buf == NULL) {
+		error = -ENOMEM;
+		goto fail_bin;
+	}
+
 	sc->attr.private = sc;
 	sc->attr.read = amzn_sfp_read;
 	sc->attr.write = amzn_sfp_write;
 	error = sysfs_create_bin_file(&client->dev.kobj, &sc->attr);
-	if (error)
+	if (error) {
 		dev_err(&client->dev,
 		    "unable to create 'eeprom' file in sysfs (error %d)\n",
 		    error);
+		goto fail_bin;
+	}
+
+	error = sysfs_create_group(&client->dev.kobj, &amzn_sfp_attr_group);
+	if (error) {
+		dev_err(&client->dev,
+		    "unable to create attributes in sysfs (error %d)\n",
+		    error);
+		goto fail_group;
+	}
+
+	error = amzn_sfp_bus_attach(sc);
+	if (error)
+		goto fail_bus;
+
+	mutex_lock(&amzn_sfp_ports_lock);
+	sc->port_id = idr_alloc(&amzn_sfp_ports, sc, 0, AMZN_SFP_MAX_PORTS,
+	    GFP_KERNEL);
+	mutex_unlock(&amzn_sfp_ports_lock);
+	if (sc->port_id < 0) {
+		error = sc->port_id;
+		dev_err(&client->dev, "unable to allocate port ID (error %d)\n",
+		    error);
+		goto fail_port;
+	}
+
+	error = amzn_sfp_presence_bind(sc);
+	if (error)
+		goto fail_presence;
+
+	sc->dev.class = amzn_sfp_class;
+	sc->dev.parent = &client->dev;
+	sc->dev.devt = MKDEV(MAJOR(amzn_sfp_devt), sc->port_id);
+	dev_set_drvdata(&sc->dev, sc);
+	error = dev_set_name(&sc->dev, "amzn-sfp%d", sc->port_id);
+	if (!error) {
+		cdev_init(&sc->cdev, &amzn_sfp_port_fops);
+		sc->cdev.owner = THIS_MODULE;
+		error = cdev_device_add(&sc->cdev, &sc->dev);
+	}
+	if (error) {
+		dev_err(&client->dev,
+		    "unable to create port device (error %d)\n", error);
+		goto fail_cdev;
+	}
+
+	/*
+	 * IntL of modules that have it, when wired to an interrupt.  The
+	 * flags are polled for otherwise, so don't fail without it.
+	 */
+	if (client->irq > 0 && sc->backend != NULL &&
+	    sc->backend->nsummaries > 0) {
+		sc->irq = client->irq;
+		error = request_threaded_irq(sc->irq, NULL, amzn_sfp_intl_irq,
+		    IRQF_ONESHOT, dev_name(&client->dev), sc);
+		if (error) {
+			dev_warn(&client->dev,
+			    "unable to request IntL interrupt (error %d)\n",
+			    error);
+			sc->irq = 0;
+		}
+	}
+
+	amzn_sfp_task_schedule(sc, AMZN_SFP_TASK_PRESENCE, 0);
+	return 0;
 
+ fail_cdev:
+	amzn_sfp_presence_unbind(sc);
+ fail_presence:
+	mutex_lock(&amzn_sfp_ports_lock);
+	idr_remove(&amzn_sfp_ports, sc->port_id);
+	mutex_unlock(&amzn_sfp_ports_lock);
+ fail_port:
+	amzn_sfp_bus_detach(sc);
+ fail_bus:
+	sysfs_remove_group(&client->dev.kobj, &amzn_sfp_attr_group);
+ fail_group:
+	sysfs_remove_bin_file(&client->dev.kobj, &sc->attr);
+ fail_bin:
+	i2c_set_clientdata(client, NULL);
+	put_device(&sc->dev);
 	return error;
 }
 
 static int amzn_sfp_remove(struct i2c_client *client)
 {
+	struct amzn_sfp_client *cl;
 	struct amzn_sfp_softc *sc;
+	int irq;
 
 	/* Paranoia... */
 	if (client == NULL)
@@ -398,10 +5874,118 @@ static int amzn_sfp_remove(struct i2c_client *client)
 	if (sc == NULL)
 		return -ENODEV;
 
+	/* Open port devices keep the softc, but not the port, around. */
+	rt_mutex_lock(&sc->lock);
+	sc->gone = true;
+	list_for_each_entry(cl, &sc->clients, link)
+		wake_up_interruptible(&cl->ev_wq);
+	/* Keep the IntL task from enabling the interrupt again. */
+	irq = sc->irq;
+	sc->irq = 0;
+	rt_mutex_unlock(&sc->lock);
+	if (irq > 0)
+		free_irq(irq, sc);
+
+	cdev_device_del(&sc->cdev, &sc->dev);
+	mutex_lock(&amzn_sfp_ports_lock);
+	idr_remove(&amzn_sfp_ports, sc->port_id);
+	mutex_unlock(&amzn_sfp_ports_lock);
+
+	amzn_sfp_presence_unbind(sc);
+	amzn_sfp_bus_detach(sc);
+	sysfs_remove_group(&client->dev.kobj, &amzn_sfp_attr_group);
 	i2c_set_clientdata(client, NULL);
 	sysfs_remove_bin_file(&client->dev.kobj, &sc->attr);
+
+	rt_mutex_lock(&sc->lock);
+	amzn_sfp_cache_flush(sc);
+	rt_mutex_unlock(&sc->lock);
+	put_device(&sc->dev);
+	return 0;
+}
+
+static void amzn_sfp_acct_show(struct seq_file *m, struct amzn_sfp_acct *a)
+{
+
+	seq_printf(m, "  %7d %8llu %-16s %10llu %12llu %10llu\n",
+	    a->owner.tgid, a->owner.cgroup, a->owner.comm, a->xfers,
+	    div_u64(a->bus_ns, NSEC_PER_USEC), a->throttled);
+}
+
+/* debugfs amzn-sfp/clients: bus time per owner, per bus and per port. */
+static int amzn_sfp_clients_show(struct seq_file *m, void *v)
+{
+	struct amzn_sfp_softc *sc;
+	struct amzn_sfp_bus *bus;
+	struct amzn_sfp_acct *a;
+	int id;
+
+	seq_printf(m, "  %7s %8s %-16s %10s %12s %10s\n", "tgid", "cgroup",
+	    "comm", "xfers", "usecs", "throttled");
+
+	mutex_lock(&amzn_sfp_buses_lock);
+	list_for_each_entry(bus, &amzn_sfp_buses, link) {
+		seq_printf(m, "bus %s\n", dev_name(&bus->adapter->dev));
+		spin_lock_bh(&bus->lock);
+		list_for_each_entry(a, &bus->accts, link)
+			amzn_sfp_acct_show(m, a);
+		spin_unlock_bh(&bus->lock);
+	}
+	mutex_unlock(&amzn_sfp_buses_lock);
+
+	mutex_lock(&amzn_sfp_ports_lock);
+	idr_for_each_entry(&amzn_sfp_ports, sc, id) {
+		seq_printf(m, "port %d %s\n", id, dev_name(&sc->client->dev));
+		rt_mutex_lock(&sc->lock);
+		list_for_each_entry(a, &sc->accts, link)
+			amzn_sfp_acct_show(m, a);
+		rt_mutex_unlock(&sc->lock);
+	}
+	mutex_unlock(&amzn_sfp_ports_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(amzn_sfp_clients);
+
+/* debugfs amzn-sfp/buses: utilisation and load shedding per bus. */
+static int amzn_sfp_buses_show(struct seq_file *m, void *v)
+{
+	struct amzn_sfp_softc *sc;
+	struct amzn_sfp_bus *bus;
+
+	mutex_lock(&amzn_sfp_buses_lock);
+	list_for_each_entry(bus, &amzn_sfp_buses, link) {
+		spin_lock_bh(&bus->lock);
+		amzn_sfp_bus_util(bus, ktime_get_ns());
+		seq_printf(m, "bus %s\n", dev_name(&bus->adapter->dev));
+		seq_printf(m, "  utilisation   %u.%u%%\n", bus->util / 10,
+		    bus->util % 10);
+		seq_printf(m, "  transfers     %llu\n", bus->xfers);
+		seq_printf(m, "  busy-us       %llu\n",
+		    div_u64(bus->busy_ns, NSEC_PER_USEC));
+		seq_printf(m, "  queue-depth   %u (max %u)\n", bus->depth,
+		    bus->max_depth);
+		seq_printf(m, "  wait-us       %llu avg, %llu max\n",
+		    bus->waits ? div64_u64(bus->wait_ns, bus->waits *
+		    NSEC_PER_USEC) : 0, div_u64(bus->max_wait_ns,
+		    NSEC_PER_USEC));
+		seq_printf(m, "  shed          %llu readahead, %llu polls\n",
+		    bus->shed_ra, bus->shed_poll);
+		list_for_each_entry(sc, &bus->ports, bus_link) {
+			if (sc->irq <= 0)
+				continue;
+			seq_printf(m, "  port %-3d IntL  %llu irqs, "
+			    "%llu serviced, %llu deferred, %llu storms%s\n",
+			    sc->port_id,
+			    sc->intl_irqs, sc->intl_serviced,
+			    sc->intl_deferred, sc->intl_storms,
+			    sc->intl_storm ? " (in storm)" : "");
+		}
+		spin_unlock_bh(&bus->lock);
+	}
+	mutex_unlock(&amzn_sfp_buses_lock);
 	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(amzn_sfp_buses);
 
 static const struct i2c_device_id amzn_sfp_ids[] = {
 	{ .name = "sfp+",	.driver_data = AMZN_SFP_TYPE_SFP_PLUS },
@@ -426,16 +6010,80 @@ static int amzn_sfp_init(struct i2c_driver *drv)
 {
 	int error;
 
+	amzn_sfp_page_cache = kmem_cache_create("amzn_sfp_page",
+	    AMZN_SFP_HALF_SIZE, 0, 0, NULL);
+	if (amzn_sfp_page_cache == NULL)
+		return -ENOMEM;
+	error = register_shrinker(&amzn_sfp_shrinker);
+	if (error)
+		goto fail_shrinker;
+
+	/* Bus workers of different buses run concurrently. */
+	amzn_sfp_wq = alloc_workqueue("amzn-sfp", WQ_UNBOUND, 0);
+	if (amzn_sfp_wq == NULL) {
+		error = -ENOMEM;
+		goto fail_wq;
+	}
+
+	error = misc_register(&amzn_sfp_ctl);
+	if (error)
+		goto fail_misc;
+
+	error = alloc_chrdev_region(&amzn_sfp_devt, 0, AMZN_SFP_MAX_PORTS,
+	    "amzn-sfp");
+	if (error)
+		goto fail_chrdev;
+	amzn_sfp_class = class_create(THIS_MODULE, "amzn-sfp");
+	if (IS_ERR(amzn_sfp_class)) {
+		error = PTR_ERR(amzn_sfp_class);
+		goto fail_class;
+	}
+
+	error = genl_register_family(&amzn_sfp_genl);
+	if (error)
+		goto fail_genl;
+
 	error = i2c_add_driver(drv);
+	if (error)
+		goto fail_driver;
 #ifdef CONFIG_SYSCTL
 	register_sysctl("debug", amzn_sfp_sysctls);
 #endif
+	amzn_sfp_debugfs = debugfs_create_dir("amzn-sfp", NULL);
+	debugfs_create_file("clients", 0444, amzn_sfp_debugfs, NULL,
+	    &amzn_sfp_clients_fops);
+	debugfs_create_file("buses", 0444, amzn_sfp_debugfs, NULL,
+	    &amzn_sfp_buses_fops);
+	return (0);
+
+ fail_driver:
+	genl_unregister_family(&amzn_sfp_genl);
+ fail_genl:
+	class_destroy(amzn_sfp_class);
+ fail_class:
+	unregister_chrdev_region(amzn_sfp_devt, AMZN_SFP_MAX_PORTS);
+ fail_chrdev:
+	misc_deregister(&amzn_sfp_ctl);
+ fail_misc:
+	destroy_workqueue(amzn_sfp_wq);
+ fail_wq:
+	unregister_shrinker(&amzn_sfp_shrinker);
+ fail_shrinker:
+	kmem_cache_destroy(amzn_sfp_page_cache);
 	return (error);
 }
 
 static void amzn_sfp_exit(struct i2c_driver *drv)
 {
+	debugfs_remove_recursive(amzn_sfp_debugfs);
 	i2c_del_driver(drv);
+	genl_unregister_family(&amzn_sfp_genl);
+	class_destroy(amzn_sfp_class);
+	unregister_chrdev_region(amzn_sfp_devt, AMZN_SFP_MAX_PORTS);
+	misc_deregister(&amzn_sfp_ctl);
+	destroy_workqueue(amzn_sfp_wq);
+	unregister_shrinker(&amzn_sfp_shrinker);
+	kmem_cache_destroy(amzn_sfp_page_cache);
 }
 
 module_driver(amzn_sfp_driver, amzn_sfp_init, amzn_sfp_exit);
@@ -0,0 +1,475 @@
+/*
+ * Copyright Amazon.com, Inc. and its affiliates. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/gpl-2.0.html>.
+ *
+ * User space interface of the driver for SFP+, QSFP+, QSFP28 and QSFP-DD
+ * modules.
+ */
+
+#ifndef _AMZN_SFP_H_
+#define	_AMZN_SFP_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* Ports are numbered 0 to AMZN_SFP_MAX_PORTS - 1.  See 'port_id'. */
+#define	AMZN_SFP_MAX_PORTS	256
+
+/*
+ * Offset in the eeprom file of byte 'byte' (128-255) of upper page
+ * 'page'.  Bytes 0-127 of the lower half are at their own offset.
+ */
+#define	AMZN_SFP_PAGE_OFFSET(page, byte)	((page) * 128 + (byte))
+
+/* A region of the eeprom file. */
+struct amzn_sfp_region {
+	__u32	offset;
+	__u16	length;
+	__u16	reserved;
+};
+
+/*
+ * Read the same region from a set of ports.  The ports are read in
+ * parallel across buses.  For every port in the set, one result is
+ * stored in the buffer, with a stride of AMZN_SFP_GATHER_STRIDE(length).
+ */
+struct amzn_sfp_gather {
+	__u64	ports[AMZN_SFP_MAX_PORTS / 64];	/* in: bitmap of ports */
+	struct amzn_sfp_region region;		/* in */
+	__u64	buf;				/* in: result buffer */
+	__u32	buflen;				/* in: size of buffer */
+	__u32	count;				/* out: number of results */
+};
+
+struct amzn_sfp_gather_result {
+	__u16	port;
+	__u16	length;		/* number of valid data bytes */
+	__s32	status;		/* 0 or negative errno */
+	__u64	timestamp;	/* CLOCK_MONOTONIC, in ns */
+	__u8	data[];
+};
+
+#define	AMZN_SFP_GATHER_STRIDE(length)					\
+	(sizeof(struct amzn_sfp_gather_result) + (((length) + 7) & ~7))
+
+/*
+ * A sampling round: a gather of fresh data, whose reads all start at a
+ * common trigger time, on all buses in parallel.  Ports on the same bus
+ * are read back to back.  The timestamp of a result is the time its read
+ * started.  All results of a round are copied out together, once the
+ * last port was read.  Rounds are numbered, across all issuers.
+ */
+struct amzn_sfp_round {
+	struct amzn_sfp_gather gather;	/* as for AMZN_SFP_IOC_GATHER */
+	__u64	trigger;	/* in: CLOCK_MONOTONIC, in ns; 0 is now */
+	__u64	round;		/* out: ID of the round */
+	__u64	spread;		/* out: first to last read start (ns) */
+};
+
+/* How far in the future the trigger of a round can be, in ns. */
+#define	AMZN_SFP_ROUND_MAX_DELAY	(10ULL * 1000000000)
+
+/*
+ * The per-port device /dev/amzn-sfp<port_id> can be mapped read-only.
+ * The mapping starts with a header, followed at data_offset by an image
+ * of the shadow cache that is laid out like the eeprom file.  A half of
+ * the image is valid when all of its bytes have been read from the
+ * module.  Only halves that hold nothing but static data, like identity
+ * and thresholds, are ever valid; read the rest through the eeprom file
+ * or poll it with interests.
+ *
+ * The generation of a half is odd while the driver updates it.  To
+ * read a half consistently: read gen, skip or retry if it's odd, read
+ * the valid bit and the data, and retry if gen changed in the meantime.
+ */
+#define	AMZN_SFP_IMAGE_MAGIC	0x50465341	/* "ASFP" */
+#define	AMZN_SFP_IMAGE_VERSION	1
+#define	AMZN_SFP_IMAGE_HALVES	257
+
+struct amzn_sfp_image_hdr {
+	__u32	magic;
+	__u16	version;
+	__u16	halves;		/* number of halves in the image */
+	__u32	data_offset;	/* offset of the image in the mapping */
+	__u32	data_size;	/* size of the eeprom file */
+	__u64	valid[(AMZN_SFP_IMAGE_HALVES + 63) / 64];
+	__u32	gen[AMZN_SFP_IMAGE_HALVES];
+};
+
+/*
+ * The 'dump' file in sysfs holds a self-describing image of a ready
+ * module: a header, a table of the halves the module has, and the data
+ * of those halves, 128 bytes each, in the order of the table.  Only the
+ * pages the module advertises are included.  Reading the file from
+ * offset 0 takes a new image; the rest of the reads continue with it.
+ * Clear-on-read bytes aren't read, so as not to lose latched flags; they
+ * are zero in the image, and the half is flagged.
+ */
+#define	AMZN_SFP_DUMP_MAGIC	0x44465341	/* "ASFD" */
+#define	AMZN_SFP_DUMP_VERSION	1
+
+struct amzn_sfp_dump_hdr {
+	__u32	magic;
+	__u16	version;
+	__u16	halves;		/* number of entries in the table */
+	__u32	table_offset;	/* of the table of halves */
+	__u32	data_offset;	/* of the data of the first half */
+	__u64	timestamp;	/* CLOCK_MONOTONIC, in ns */
+	char	backend[16];	/* "sff8472", "sff8636" or "cmis" */
+	__u8	identifier;	/* SFF-8024 identifier */
+	__u8	reserved[3];
+	__u32	fingerprint;	/* CRC32 of the identity page */
+	char	vendor_name[17];
+	char	vendor_pn[17];
+	char	vendor_rev[5];
+	char	vendor_sn[17];
+	char	date_code[9];
+	__u8	pad[7];
+};
+
+struct amzn_sfp_dump_half {
+	__u32	offset;		/* in the eeprom file */
+	__u16	flags;
+	__u16	reserved;
+	__u64	timestamp;	/* CLOCK_MONOTONIC, when read */
+};
+
+#define	AMZN_SFP_DUMP_HALF_PARTIAL	0x0001	/* clear-on-read bytes zeroed */
+
+/*
+ * Interest of a client of a port device in a region of the eeprom file.
+ * The driver merges the interests of all clients of a port into one
+ * poll plan, in which every byte is read at the fastest interval any
+ * client asked for.  Each client gets an AMZN_SFP_EVENT_DATA event for
+ * each of its interests at its own interval.  An interval of 0 removes
+ * the interest with the same region.
+ */
+struct amzn_sfp_interest {
+	struct amzn_sfp_region region;
+	__u32	interval_ms;
+	__u32	reserved;
+};
+
+#define	AMZN_SFP_MAX_INTERESTS		16	/* per client */
+#define	AMZN_SFP_MIN_INTERVAL_MS	10
+
+/*
+ * Events, as read(2) from a port device.  Every read returns one or
+ * more whole events, each AMZN_SFP_EVENT_SIZE(length) bytes long.
+ */
+struct amzn_sfp_event {
+	__u16	type;
+	__u16	length;		/* number of data bytes */
+	__u32	offset;		/* in the eeprom file */
+	__s32	status;		/* 0 or negative errno */
+	__u32	flags;
+	__u64	timestamp;	/* CLOCK_MONOTONIC, in ns */
+	__u8	data[];
+};
+
+#define	AMZN_SFP_EVENT_SIZE(length)					\
+	(sizeof(struct amzn_sfp_event) + (((length) + 7) & ~7))
+
+/* Event types */
+#define	AMZN_SFP_EVENT_DATA	1	/* polled data of an interest */
+#define	AMZN_SFP_EVENT_TUNED	2	/* tuning done; status says how */
+#define	AMZN_SFP_EVENT_BURST	3	/* burst capture done */
+#define	AMZN_SFP_EVENT_PM	4	/* new C-CMIS PM snapshot */
+#define	AMZN_SFP_EVENT_DIAG	5	/* diagnostic session ended */
+#define	AMZN_SFP_EVENT_THRESHOLD 6	/* a threshold was crossed */
+#define	AMZN_SFP_EVENT_INTL	7	/* IntL serviced; data is a sample */
+
+/* Event flags */
+#define	AMZN_SFP_EVENT_LOST	0x0001	/* events were lost before this one */
+
+/*
+ * A software threshold of a client of a port device on a 1 or 2 byte
+ * big-endian field of the eeprom file, like a monitor.  The driver polls
+ * the field every interval_ms.  A high threshold is raised when the value
+ * reaches 'set' and cleared when it falls back to 'clear' or below; a low
+ * threshold (AMZN_SFP_THRESH_LOW) the other way around.  The gap between
+ * the two is the hysteresis.  Every raise and clear is an
+ * AMZN_SFP_EVENT_THRESHOLD event carrying a struct amzn_sfp_crossing.
+ * An interval of 0 removes the threshold with the same id.
+ */
+struct amzn_sfp_threshold {
+	__u32	offset;		/* of the field */
+	__u8	size;		/* of the field: 1 or 2 */
+	__u8	flags;
+	__u16	id;		/* chosen by the client */
+	__s32	set;
+	__s32	clear;
+	__u32	interval_ms;
+	__u32	reserved;
+};
+
+#define	AMZN_SFP_THRESH_SIGNED	0x01	/* the field is two's complement */
+#define	AMZN_SFP_THRESH_LOW	0x02	/* raised at or below 'set' */
+
+#define	AMZN_SFP_MAX_THRESHOLDS	16	/* per client */
+
+struct amzn_sfp_crossing {
+	__u16	id;
+	__u8	raised;		/* 1 when raised, 0 when cleared */
+	__u8	reserved;
+	__s32	value;		/* that crossed */
+};
+
+/*
+ * Subscribe a client of a port device to interrupt flags of the module:
+ * the bits set in 'bits' of the 'length' flag bytes at 'offset' of the
+ * eeprom file.  The driver masks every maskable flag that no client of
+ * the port subscribed to, so that only those assert IntL.  Without any
+ * subscriptions, the masks of the module are left at their defaults.
+ * A subscription with all bits clear removes the one with the same
+ * offset and length.
+ */
+struct amzn_sfp_flags {
+	__u32	offset;		/* of the first flag byte */
+	__u16	length;		/* number of flag bytes */
+	__u16	reserved;
+	__u8	bits[32];
+};
+
+#define	AMZN_SFP_MAX_FLAG_SUBS	8	/* per client */
+
+/*
+ * The active lanes of a port, for breakout configurations and lanes that
+ * are administratively down.  The per-lane monitors of inactive lanes
+ * are left out of the poll plan of the port; their bytes in polled data
+ * are stale or zero.  With AMZN_SFP_LANES_AUTO, the lanes of a CMIS
+ * module whose data path is deactivated are inactive and 'mask' is
+ * ignored.  The mask in effect is copied out.
+ */
+struct amzn_sfp_lanes {
+	__u32	mask;		/* bit N: lane N + 1 is active */
+	__u32	flags;
+};
+
+#define	AMZN_SFP_LANES_AUTO	0x0001	/* follow the data path states */
+
+/*
+ * Tune the transmitter of a tunable SFP+ module (SFF-8690) to a channel
+ * or a wavelength.  The ioctl returns as soon as the module has been
+ * told; all clients of the port get an AMZN_SFP_EVENT_TUNED event when
+ * the module is done.  The status of the event is 0 when the module
+ * acquired the new channel, EINVAL when it rejected it and ETIMEDOUT
+ * when it didn't finish in time.
+ */
+struct amzn_sfp_tune {
+	__u32	flags;
+	__u16	channel;	/* with AMZN_SFP_TUNE_CHANNEL */
+	__u16	wavelength;	/* in 0.05nm, with AMZN_SFP_TUNE_WAVELENGTH */
+	__u32	timeout_ms;	/* 0 for the default of 30s */
+	__u32	reserved;
+};
+
+#define	AMZN_SFP_TUNE_CHANNEL		0x0001
+#define	AMZN_SFP_TUNE_WAVELENGTH	0x0002
+
+/*
+ * A sample of the diagnostics of a module: its monitors and flags, in
+ * the order of the eeprom file.  Which bytes make up a sample depends
+ * on the management interface of the module; see the README.
+ */
+struct amzn_sfp_sample {
+	__u64	timestamp;	/* CLOCK_MONOTONIC, in ns */
+	__u32	flags;
+	__u16	length;		/* number of data bytes */
+	__u16	reserved;
+	__u8	data[];
+};
+
+#define	AMZN_SFP_SAMPLE_STRIDE(length)					\
+	(sizeof(struct amzn_sfp_sample) + (((length) + 7) & ~7))
+
+/* Sample flags */
+#define	AMZN_SFP_SAMPLE_BURST	0x0001	/* taken by a burst */
+#define	AMZN_SFP_SAMPLE_LATCHED	0x0002	/* latched flags included */
+
+/*
+ * Take count samples, interval_ms apart, as soon as possible.  They go
+ * into the history of the port and all clients of the port get an
+ * AMZN_SFP_EVENT_BURST event when the burst is done.  Only with
+ * AMZN_SFP_BURST_LATCHED do the samples include the latched flags,
+ * which reading clears for everyone else.  A burst goes ahead of all
+ * other work on the bus and a sample takes up to about 10ms of a 100kHz
+ * bus, so the interval is at least AMZN_SFP_BURST_MIN_INTERVAL_MS to
+ * leave the bus to the other ports most of the time.
+ */
+struct amzn_sfp_burst {
+	__u32	count;
+	__u32	interval_ms;
+	__u32	flags;
+	__u32	reserved;
+};
+
+/* Burst flags */
+#define	AMZN_SFP_BURST_LATCHED	0x0001	/* read the latched flags */
+
+#define	AMZN_SFP_BURST_MIN_INTERVAL_MS	50
+
+#define	AMZN_SFP_HISTORY_LEN	128	/* samples kept per port */
+
+/*
+ * Copy the samples in the history of the port taken after 'since',
+ * oldest first, to the buffer, with a stride of
+ * AMZN_SFP_SAMPLE_STRIDE(length).
+ */
+struct amzn_sfp_history {
+	__u64	since;		/* in: timestamp */
+	__u64	buf;		/* in: buffer */
+	__u32	buflen;		/* in: size of buffer */
+	__u32	count;		/* out: number of samples */
+};
+
+/*
+ * The latest performance monitoring snapshot of a coherent (C-CMIS)
+ * module: upper pages 33h, 34h and 35h, read while frozen.
+ */
+struct amzn_sfp_pm {
+	__u64	buf;		/* in: buffer */
+	__u32	buflen;		/* in: size of buffer */
+	__u32	length;		/* out: size of the snapshot */
+	__u64	timestamp;	/* out: CLOCK_MONOTONIC, in ns */
+	__s32	status;		/* out: 0 or negative errno */
+	__u32	reserved;
+};
+
+/*
+ * A PRBS diagnostic session on a CMIS module (pages 13h and 14h).  The
+ * driver enables the generators, checkers and loopbacks given by flags
+ * on the given lanes, and reads the error and bit counters of the
+ * checkers every interval_ms, accumulating them.  A session with a
+ * duration ends by itself, with an AMZN_SFP_EVENT_DIAG event for all
+ * clients of the port; otherwise it runs until stopped.
+ */
+struct amzn_sfp_diag {
+	__u32	flags;
+	__u8	lanes;		/* bitmap of lanes 1-8 */
+	__u8	pattern;	/* PRBS pattern, as coded by CMIS */
+	__u16	reserved;
+	__u32	interval_ms;	/* 0 for the default of 1s */
+	__u32	duration_ms;	/* 0 to run until stopped */
+};
+
+#define	AMZN_SFP_DIAG_GEN_HOST		0x0001	/* host side generator */
+#define	AMZN_SFP_DIAG_GEN_MEDIA		0x0002	/* media side generator */
+#define	AMZN_SFP_DIAG_CHK_HOST		0x0004	/* host side checker */
+#define	AMZN_SFP_DIAG_CHK_MEDIA		0x0008	/* media side checker */
+#define	AMZN_SFP_DIAG_LB_MEDIA_OUT	0x0010	/* media output loopback */
+#define	AMZN_SFP_DIAG_LB_MEDIA_IN	0x0020	/* media input loopback */
+#define	AMZN_SFP_DIAG_LB_HOST_OUT	0x0040	/* host output loopback */
+#define	AMZN_SFP_DIAG_LB_HOST_IN	0x0080	/* host input loopback */
+
+#define	AMZN_SFP_DIAG_SIDE_HOST		0
+#define	AMZN_SFP_DIAG_SIDE_MEDIA	1
+
+/*
+ * The accumulated counters of the current or last session of a port.
+ * The bit error ratio of a lane is errors / bits.
+ */
+struct amzn_sfp_diag_result {
+	__u64	start;		/* CLOCK_MONOTONIC, in ns */
+	__u64	timestamp;	/* of the last counter read */
+	__s32	status;		/* 0 or negative errno */
+	__u32	flags;		/* of the session */
+	__u8	lanes;		/* of the session */
+	__u8	active;		/* whether the session still runs */
+	__u16	reserved[3];
+	struct {
+		__u64	errors;
+		__u64	bits;
+	} counts[2][8];		/* [AMZN_SFP_DIAG_SIDE_*][lane - 1] */
+};
+
+/*
+ * Generic netlink family of the driver.  Module insertion, removal,
+ * readiness, identity, latched alarms and threshold crossings are
+ * multicast to the group of the same name, as a message with the command
+ * of the event.  Every message carries the port, the I2C device and the
+ * time of the event; the rest depends on the command:
+ *
+ *   INSERT, REMOVE, READY	STATE
+ *   IDENTITY			IDENTIFIER, VENDOR_NAME, VENDOR_PN,
+ *				VENDOR_SN, FINGERPRINT
+ *   ALARM			FLAGS: the latched flags, in the order of
+ *				the flag ranges of a history sample
+ *   THRESHOLD			OFFSET, CROSSING (a struct
+ *				amzn_sfp_crossing)
+ *
+ * Messages are only built when the group has listeners.
+ */
+#define	AMZN_SFP_GENL_NAME	"amzn_sfp"
+#define	AMZN_SFP_GENL_VERSION	1
+
+#define	AMZN_SFP_MCGRP_INSERT		"insert"
+#define	AMZN_SFP_MCGRP_REMOVE		"remove"
+#define	AMZN_SFP_MCGRP_READY		"ready"
+#define	AMZN_SFP_MCGRP_IDENTITY		"identity"
+#define	AMZN_SFP_MCGRP_ALARM		"alarm"
+#define	AMZN_SFP_MCGRP_THRESHOLD	"threshold"
+
+enum {
+	AMZN_SFP_CMD_UNSPEC,
+	AMZN_SFP_CMD_INSERT,
+	AMZN_SFP_CMD_REMOVE,
+	AMZN_SFP_CMD_READY,
+	AMZN_SFP_CMD_IDENTITY,
+	AMZN_SFP_CMD_ALARM,
+	AMZN_SFP_CMD_THRESHOLD,
+	__AMZN_SFP_CMD_MAX,
+};
+#define	AMZN_SFP_CMD_MAX	(__AMZN_SFP_CMD_MAX - 1)
+
+enum {
+	AMZN_SFP_ATTR_UNSPEC,
+	AMZN_SFP_ATTR_PAD,
+	AMZN_SFP_ATTR_PORT,		/* u32: port_id */
+	AMZN_SFP_ATTR_DEVICE,		/* string: I2C device name */
+	AMZN_SFP_ATTR_TIMESTAMP,	/* u64: CLOCK_MONOTONIC, in ns */
+	AMZN_SFP_ATTR_STATE,		/* string: as in the state file */
+	AMZN_SFP_ATTR_IDENTIFIER,	/* u8: SFF-8024 identifier */
+	AMZN_SFP_ATTR_VENDOR_NAME,	/* string */
+	AMZN_SFP_ATTR_VENDOR_PN,	/* string */
+	AMZN_SFP_ATTR_VENDOR_SN,	/* string */
+	AMZN_SFP_ATTR_FINGERPRINT,	/* u32: CRC32 of the identity page */
+	AMZN_SFP_ATTR_FLAGS,		/* binary */
+	AMZN_SFP_ATTR_OFFSET,		/* u32: in the eeprom file */
+	AMZN_SFP_ATTR_CROSSING,		/* binary */
+	__AMZN_SFP_ATTR_MAX,
+};
+#define	AMZN_SFP_ATTR_MAX	(__AMZN_SFP_ATTR_MAX - 1)
+
+#define	AMZN_SFP_IOC_MAGIC	0xb5
+
+/* ioctls on /dev/amzn-sfp */
+#define	AMZN_SFP_IOC_GATHER	_IOWR(AMZN_SFP_IOC_MAGIC, 1, struct amzn_sfp_gather)
+#define	AMZN_SFP_IOC_ROUND	_IOWR(AMZN_SFP_IOC_MAGIC, 13, struct amzn_sfp_round)
+
+/* ioctls on /dev/amzn-sfp<port_id> */
+#define	AMZN_SFP_IOC_INTEREST	_IOW(AMZN_SFP_IOC_MAGIC, 2, struct amzn_sfp_interest)
+#define	AMZN_SFP_IOC_TUNE	_IOW(AMZN_SFP_IOC_MAGIC, 3, struct amzn_sfp_tune)
+#define	AMZN_SFP_IOC_BURST	_IOW(AMZN_SFP_IOC_MAGIC, 4, struct amzn_sfp_burst)
+#define	AMZN_SFP_IOC_HISTORY	_IOWR(AMZN_SFP_IOC_MAGIC, 5, struct amzn_sfp_history)
+#define	AMZN_SFP_IOC_PM		_IOWR(AMZN_SFP_IOC_MAGIC, 6, struct amzn_sfp_pm)
+#define	AMZN_SFP_IOC_DIAG_START	_IOW(AMZN_SFP_IOC_MAGIC, 7, struct amzn_sfp_diag)
+#define	AMZN_SFP_IOC_DIAG_STOP	_IO(AMZN_SFP_IOC_MAGIC, 8)
+#define	AMZN_SFP_IOC_DIAG_RESULT _IOR(AMZN_SFP_IOC_MAGIC, 9, struct amzn_sfp_diag_result)
+#define	AMZN_SFP_IOC_THRESHOLD	_IOW(AMZN_SFP_IOC_MAGIC, 10, struct amzn_sfp_threshold)
+#define	AMZN_SFP_IOC_FLAGS	_IOW(AMZN_SFP_IOC_MAGIC, 11, struct amzn_sfp_flags)
+#define	AMZN_SFP_IOC_LANES	_IOWR(AMZN_SFP_IOC_MAGIC, 12, struct amzn_sfp_lanes)
+
+#endif /* _AMZN_SFP_H_ */
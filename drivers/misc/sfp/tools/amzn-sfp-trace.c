@@ -0,0 +1,451 @@
+/*
+ * Copyright Amazon.com, Inc. and its affiliates. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/gpl-2.0.html>.
+ *
+ * Record the requests made of the amzn-sfp driver, from its
+ * amzn_sfp_request tracepoint, in a compact binary format and replay
+ * them against the modules of any system running the driver.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	TRACE_MAGIC	"ASFPTRC1"
+
+#define	OP_READ		0
+#define	OP_WRITE	1
+#define	OP_GATHER	2
+#define	NOPS		3
+
+#define	MAX_PORTS	256
+#define	MAX_LENGTH	(257 * 128)
+
+/*
+ * The trace file is the magic, followed by fixed-size records in host
+ * byte order.  Time is kept as the delta to the previous record.
+ */
+struct trace_rec {
+	uint32_t	delta_us;
+	uint32_t	offset;
+	uint16_t	port;
+	uint16_t	length;
+	uint8_t		op;
+	uint8_t		reserved[3];
+};
+
+static const char *op_names[NOPS] = { "read", "write", "gather" };
+
+static const char *tracefs = "/sys/kernel/tracing";
+static volatile sig_atomic_t stop;
+
+static void
+usage(void)
+{
+
+	fprintf(stderr,
+	    "usage: amzn-sfp-trace record [-t tracefs] file\n"
+	    "       amzn-sfp-trace replay [-f] [-n loops] file\n"
+	    "       amzn-sfp-trace dump file\n");
+	exit(2);
+}
+
+static void
+on_signal(int sig)
+{
+
+	(void)sig;
+	stop = 1;
+}
+
+static int
+tracefs_write(const char *name, const char *val)
+{
+	char path[512];
+	int fd, error = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", tracefs, name);
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd < 0)
+		return -errno;
+	if (write(fd, val, strlen(val)) < 0)
+		error = -errno;
+	close(fd);
+	return error;
+}
+
+static int
+op_lookup(const char *name)
+{
+	int op;
+
+	for (op = 0; op < NOPS; op++) {
+		if (strcmp(name, op_names[op]) == 0)
+			return op;
+	}
+	return -1;
+}
+
+/*
+ * Parse a line of trace_pipe, like:
+ *   daemon-123 [002] ..... 4711.000042: amzn_sfp_request: port=3 op=read
+ *   offset=128 length=64
+ * Returns 1 if it's a request, with its timestamp in us.
+ */
+static int
+parse_line(const char *line, uint64_t *ts, struct trace_rec *rec)
+{
+	unsigned long long sec, usec;
+	unsigned int port, offset, length;
+	const char *p, *ev;
+	char opname[16];
+	int op;
+
+	ev = strstr(line, ": amzn_sfp_request: ");
+	if (ev == NULL)
+		return 0;
+	/* The timestamp is the last word before the event name. */
+	for (p = ev; p > line && p[-1] != ' '; p--)
+		;
+	if (sscanf(p, "%llu.%llu", &sec, &usec) != 2)
+		return 0;
+	if (sscanf(ev, ": amzn_sfp_request: port=%u op=%15s offset=%u "
+	    "length=%u", &port, opname, &offset, &length) != 4)
+		return 0;
+	op = op_lookup(opname);
+	if (op < 0 || port >= MAX_PORTS || length > MAX_LENGTH)
+		return 0;
+
+	*ts = sec * 1000000 + usec;
+	memset(rec, 0, sizeof(*rec));
+	rec->offset = offset;
+	rec->port = port;
+	rec->length = length;
+	rec->op = op;
+	return 1;
+}
+
+static int
+cmd_record(int argc, char **argv)
+{
+	uint64_t ts, last = 0;
+	struct trace_rec rec;
+	char path[512], line[1024];
+	unsigned long count = 0;
+	struct sigaction sa;
+	FILE *in, *out;
+	int ch, error;
+
+	while ((ch = getopt(argc, argv, "t:")) != -1) {
+		switch (ch) {
+		case 't':
+			tracefs = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind + 1 != argc)
+		usage();
+
+	out = fopen(argv[optind], "wb");
+	if (out == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+	fwrite(TRACE_MAGIC, 1, 8, out);
+
+	error = tracefs_write("events/amzn_sfp/amzn_sfp_request/enable", "1");
+	if (error) {
+		fprintf(stderr, "cannot enable tracepoint: %s\n",
+		    strerror(-error));
+		fclose(out);
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/trace_pipe", tracefs);
+	in = fopen(path, "r");
+	if (in == NULL) {
+		perror(path);
+		tracefs_write("events/amzn_sfp/amzn_sfp_request/enable", "0");
+		fclose(out);
+		return 1;
+	}
+
+	/* No SA_RESTART, so that a signal interrupts the read. */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	fprintf(stderr, "recording; interrupt to stop\n");
+	while (!stop && fgets(line, sizeof(line), in) != NULL) {
+		if (!parse_line(line, &ts, &rec))
+			continue;
+		rec.delta_us = (count == 0 || ts < last) ? 0 :
+		    (ts - last > UINT32_MAX) ? UINT32_MAX : ts - last;
+		last = ts;
+		fwrite(&rec, sizeof(rec), 1, out);
+		count++;
+	}
+
+	tracefs_write("events/amzn_sfp/amzn_sfp_request/enable", "0");
+	fclose(in);
+	fclose(out);
+	fprintf(stderr, "%lu requests recorded\n", count);
+	return 0;
+}
+
+static FILE *
+trace_open(const char *name)
+{
+	char magic[8];
+	FILE *fp;
+
+	fp = fopen(name, "rb");
+	if (fp == NULL) {
+		perror(name);
+		return NULL;
+	}
+	if (fread(magic, 1, 8, fp) != 8 ||
+	    memcmp(magic, TRACE_MAGIC, 8) != 0) {
+		fprintf(stderr, "%s: not an amzn-sfp trace\n", name);
+		fclose(fp);
+		return NULL;
+	}
+	return fp;
+}
+
+static int
+cmd_dump(int argc, char **argv)
+{
+	struct trace_rec rec;
+	uint64_t us = 0;
+	FILE *fp;
+
+	if (argc != 2)
+		usage();
+	fp = trace_open(argv[1]);
+	if (fp == NULL)
+		return 1;
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		us += rec.delta_us;
+		printf("%" PRIu64 ".%06" PRIu64 " port=%u op=%s offset=%u "
+		    "length=%u\n", us / 1000000, us % 1000000, rec.port,
+		    rec.op < NOPS ? op_names[rec.op] : "?", rec.offset,
+		    rec.length);
+	}
+	fclose(fp);
+	return 0;
+}
+
+/*
+ * Find the eeprom files of the ports by their port_id.  The I2C device
+ * directories of the driver are the ones with a port_id file.
+ */
+static void
+find_ports(int *fds)
+{
+	char path[512];
+	struct dirent *de;
+	unsigned int port;
+	FILE *fp;
+	DIR *dir;
+	int fd;
+
+	for (port = 0; port < MAX_PORTS; port++)
+		fds[port] = -1;
+	dir = opendir("/sys/bus/i2c/devices");
+	if (dir == NULL)
+		return;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/sys/bus/i2c/devices/%s/port_id",
+		    de->d_name);
+		fp = fopen(path, "r");
+		if (fp == NULL)
+			continue;
+		if (fscanf(fp, "%u", &port) == 1 && port < MAX_PORTS) {
+			snprintf(path, sizeof(path),
+			    "/sys/bus/i2c/devices/%s/eeprom", de->d_name);
+			fd = open(path, O_RDONLY);
+			if (fd >= 0)
+				fds[port] = fd;
+		}
+		fclose(fp);
+	}
+	closedir(dir);
+}
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+struct op_stats {
+	uint32_t	*lat;
+	size_t		count;
+	size_t		size;
+	unsigned long	errors;
+};
+
+static void
+stats_add(struct op_stats *st, uint32_t us)
+{
+	uint32_t *lat;
+
+	if (st->count == st->size) {
+		st->size = st->size ? 2 * st->size : 1024;
+		lat = realloc(st->lat, st->size * sizeof(*lat));
+		if (lat == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+		st->lat = lat;
+	}
+	st->lat[st->count++] = us;
+}
+
+static void
+stats_print(const char *name, struct op_stats *st)
+{
+	uint64_t sum = 0;
+	size_t i;
+
+	if (st->count == 0)
+		return;
+	qsort(st->lat, st->count, sizeof(*st->lat), cmp_u32);
+	for (i = 0; i < st->count; i++)
+		sum += st->lat[i];
+	printf("%-7s %8zu %7lu %9" PRIu64 " %9u %9u %9u\n", name, st->count,
+	    st->errors, sum / st->count, st->lat[st->count / 2],
+	    st->lat[st->count * 99 / 100], st->lat[st->count - 1]);
+}
+
+/*
+ * Replay the recorded requests, with the original timing or as fast as
+ * possible.  Writes are never replayed, because their data isn't
+ * recorded, and gathers are replayed as reads of the port.
+ */
+static int
+cmd_replay(int argc, char **argv)
+{
+	unsigned long loops = 1, loop, missing = 0, skipped = 0;
+	struct op_stats stats[NOPS];
+	struct trace_rec rec;
+	uint64_t start, t, due;
+	int fds[MAX_PORTS];
+	static char buf[MAX_LENGTH];
+	int ch, fast = 0, op;
+	ssize_t result;
+	FILE *fp;
+
+	while ((ch = getopt(argc, argv, "fn:")) != -1) {
+		switch (ch) {
+		case 'f':
+			fast = 1;
+			break;
+		case 'n':
+			loops = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind + 1 != argc)
+		usage();
+
+	fp = trace_open(argv[optind]);
+	if (fp == NULL)
+		return 1;
+	find_ports(fds);
+	memset(stats, 0, sizeof(stats));
+
+	for (loop = 0; loop < loops; loop++) {
+		fseek(fp, 8, SEEK_SET);
+		start = now_us();
+		due = 0;
+		while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+			due += rec.delta_us;
+			if (rec.op == OP_WRITE || rec.op >= NOPS) {
+				skipped++;
+				continue;
+			}
+			if (fds[rec.port] < 0 || rec.length > MAX_LENGTH) {
+				missing++;
+				continue;
+			}
+			if (!fast) {
+				t = now_us() - start;
+				if (t < due)
+					usleep(due - t);
+			}
+
+			op = rec.op;
+			t = now_us();
+			result = pread(fds[rec.port], buf, rec.length,
+			    rec.offset);
+			t = now_us() - t;
+			if (result < 0)
+				stats[op].errors++;
+			stats_add(&stats[op], t > UINT32_MAX ? UINT32_MAX : t);
+		}
+	}
+	fclose(fp);
+
+	printf("%-7s %8s %7s %9s %9s %9s %9s\n", "op", "count", "errors",
+	    "avg-us", "p50-us", "p99-us", "max-us");
+	for (op = 0; op < NOPS; op++)
+		stats_print(op_names[op], &stats[op]);
+	if (missing != 0)
+		printf("%lu requests for ports not on this system\n", missing);
+	if (skipped != 0)
+		printf("%lu writes not replayed\n", skipped);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+
+	if (argc < 2)
+		usage();
+	if (strcmp(argv[1], "record") == 0)
+		return cmd_record(argc - 1, argv + 1);
+	if (strcmp(argv[1], "replay") == 0)
+		return cmd_replay(argc - 1, argv + 1);
+	if (strcmp(argv[1], "dump") == 0)
+		return cmd_dump(argc - 1, argv + 1);
+	usage();
+	return 2;
+}